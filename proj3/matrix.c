@@ -4,16 +4,33 @@
  * Deadline: 3/24/12
  *
  * Perform matrix multiplication project from textbook using pthreads.
+ *
+ * gemm() is the general form, after BLAS: C = alpha * op(A) * op(B) +
+ * beta * C, where op(X) is X or its transpose. Matrices are row-major or
+ * column-major and are addressed through a leading dimension, so a
+ * sub-matrix of a larger one can be passed in place. Each element of C is
+ * scaled and accumulated as it is stored, in one pass over C. The rows of
+ * C are split among threads.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #define M 3
 #define K 2
 #define N 3
 
+// Layouts and transpose flags of gemm()
+#define GEMM_ROW_MAJOR 0
+#define GEMM_COL_MAJOR 1
+#define GEMM_NO_TRANS 0
+#define GEMM_TRANS 1
+
+#define GEMM_MAX_THREADS 16
+#define GEMM_MIN_WORK 65536 // Multiply-adds below which threads do not pay
+
 int A [M][K] = { {1,4}, {2,5}, {3,6} };
 int B [K][N] = { {8,7,6}, {5,4,3} };
 int C [M][N];
@@ -23,21 +40,214 @@ struct v {
   int j; // Column
 };
 
+// One gemm() call, with each operand reduced to a row and a column stride
+struct gemm_args {
+  int m, n, k;
+  int alpha, beta;
+  const int *a, *b;
+  int *c;
+  long a_row, a_col;    // Strides between rows and columns of op(A)
+  long b_row, b_col;    // Same for op(B)
+  long c_row, c_col;    // Same for C
+};
+
+// Rows [start, end) of C, computed by one thread
+struct gemm_job {
+  const struct gemm_args *g;
+  int start, end;
+  pthread_t thread;
+};
+
+int gemm(int layout, int trans_a, int trans_b, int m, int n, int k,
+    int alpha, const int *a, int lda, const int *b, int ldb,
+    int beta, int *c, int ldc);
+
 void *multiply(void *arg){
   struct v* param = (struct v *)arg;
   int i = param->i;
   int j = param->j;
-  C[i][j] = 0;
 
-  int k;
-  for (k = 0; k < K; k++)
-    C[i][j] += A[i][k] * B[k][j];
-    
+  // One element: row i of A times column j of B
+  gemm(GEMM_ROW_MAJOR, GEMM_NO_TRANS, GEMM_NO_TRANS, 1, 1, K, 1, A[i], K,
+      &B[0][j], N, 0, &C[i][j], N);
+
   free(arg); // Free data that was malloc'd earlier?
   pthread_exit(NULL);
   return 0;
 }
 
+static void *gemm_rows(void *arg){
+  struct gemm_job *job = arg;
+  const struct gemm_args *g = job->g;
+  const int *a, *b;
+  int *c;
+  int i, j, l, sum;
+
+  for (i = job->start; i < job->end; i++){
+    a = g->a + i * g->a_row;
+    for (j = 0; j < g->n; j++){
+      b = g->b + j * g->b_col;
+      sum = 0;
+      for (l = 0; l < g->k; l++)
+        sum += a[l * g->a_col] * b[l * g->b_row];
+
+      // Scale and accumulate in the store; C is not read when beta is 0
+      c = g->c + i * g->c_row + j * g->c_col;
+      *c = g->beta ? g->alpha * sum + g->beta * *c : g->alpha * sum;
+    }
+  }
+  return NULL;
+}
+
+// Sets the strides between rows and between columns of op(X), for X stored
+// with layout and leading dimension ld, and transposed if trans is set
+static void strides(int layout, int trans, int ld, long *row, long *col){
+  if ((layout == GEMM_ROW_MAJOR) != (trans == GEMM_TRANS)){
+    *row = ld;
+    *col = 1;
+  }
+  else {
+    *row = 1;
+    *col = ld;
+  }
+}
+
+// Returns the smallest leading dimension of an r by c matrix, as stored
+static int min_ld(int layout, int r, int c){
+  int ld = layout == GEMM_ROW_MAJOR ? c : r;
+  return ld > 1 ? ld : 1;
+}
+
+/* Function to compute C = alpha * op(A) * op(B) + beta * C, where op(A) is
+ * m by k, op(B) is k by n and C is m by n. op(X) is X, or its transpose if
+ * trans_a or trans_b (args 2 and 3) is GEMM_TRANS. All three matrices are
+ * stored with layout (arg 1), GEMM_ROW_MAJOR or GEMM_COL_MAJOR, and lda,
+ * ldb and ldc are the distances between the starts of their rows
+ * (row-major) or columns (column-major). C may not overlap A or B.
+ *
+ * Returns 0 if successful, -1 indicating invalid arguments
+ */
+int gemm(int layout, int trans_a, int trans_b, int m, int n, int k,
+    int alpha, const int *a, int lda, const int *b, int ldb,
+    int beta, int *c, int ldc){
+  struct gemm_args g;
+  struct gemm_job jobs[GEMM_MAX_THREADS];
+  int threads, per, t;
+  long work;
+
+  if ((layout != GEMM_ROW_MAJOR && layout != GEMM_COL_MAJOR) ||
+      (trans_a != GEMM_NO_TRANS && trans_a != GEMM_TRANS) ||
+      (trans_b != GEMM_NO_TRANS && trans_b != GEMM_TRANS) ||
+      m < 0 || n < 0 || k < 0)
+    return -1;
+
+  // A leading dimension covers a whole row or column of the stored matrix
+  if (lda < (trans_a == GEMM_TRANS ? min_ld(layout, k, m) :
+        min_ld(layout, m, k)) ||
+      ldb < (trans_b == GEMM_TRANS ? min_ld(layout, n, k) :
+        min_ld(layout, k, n)) ||
+      ldc < min_ld(layout, m, n))
+    return -1;
+  if (m == 0 || n == 0)
+    return 0;
+
+  g.m = m;
+  g.n = n;
+  g.k = k;
+  g.alpha = alpha;
+  g.beta = beta;
+  g.a = a;
+  g.b = b;
+  g.c = c;
+  strides(layout, trans_a, lda, &g.a_row, &g.a_col);
+  strides(layout, trans_b, ldb, &g.b_row, &g.b_col);
+  strides(layout, GEMM_NO_TRANS, ldc, &g.c_row, &g.c_col);
+
+  // Give each thread an equal run of rows, if the work is worth threads
+  work = (long)m * n * (k ? k : 1);
+  threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > GEMM_MAX_THREADS)
+    threads = GEMM_MAX_THREADS;
+  if (threads > work / GEMM_MIN_WORK)
+    threads = work / GEMM_MIN_WORK;
+  if (threads > m)
+    threads = m;
+  if (threads < 1)
+    threads = 1;
+  per = (m + threads - 1) / threads;
+
+  for (t = 0; t < threads; t++){
+    jobs[t].g = &g;
+    jobs[t].start = t * per < m ? t * per : m;
+    jobs[t].end = (t + 1) * per < m ? (t + 1) * per : m;
+  }
+
+  // Rows [0, per) are computed here while the threads do theirs. The run
+  // of a thread that could not be created is computed in place of its join.
+  for (t = 1; t < threads; t++)
+    if (pthread_create(&jobs[t].thread, NULL, gemm_rows, &jobs[t]))
+      jobs[t].g = NULL;
+  gemm_rows(&jobs[0]);
+  for (t = 1; t < threads; t++){
+    if (jobs[t].g)
+      pthread_join(jobs[t].thread, NULL);
+    else {
+      jobs[t].g = &g;
+      gemm_rows(&jobs[t]);
+    }
+  }
+  return 0;
+}
+
+// Checks gemm() with transposes, column-major storage, a sub-matrix view
+// and scaling against C as computed by the threads. Returns 0 if all agree.
+static int check_gemm(void){
+  int at[K][M];               // A transposed, row-major
+  int bt[K * N];              // B transposed, column-major
+  int big[M + 1][N + 2];      // C goes into the middle of this
+  int c2[M][N], c3[N * M];
+  int i, j, bad = 0;
+
+  for (i = 0; i < M; i++)
+    for (j = 0; j < K; j++)
+      at[j][i] = A[i][j];
+  for (i = 0; i < K; i++)
+    for (j = 0; j < N; j++)
+      bt[i * N + j] = B[i][j]; // Column i of B^T is row i of B
+
+  // c2 = 2 * op(A^T) * B + 1 * c2, with c2 = C to begin with: 3 * C
+  for (i = 0; i < M; i++)
+    for (j = 0; j < N; j++)
+      c2[i][j] = C[i][j];
+  bad |= gemm(GEMM_ROW_MAJOR, GEMM_TRANS, GEMM_NO_TRANS, M, N, K, 2, at[0],
+      M, B[0], N, 1, c2[0], N);
+
+  // c3 = B^T * A^T = C^T, column-major; read row-major, that is C again.
+  // Row-major A is A^T in column-major.
+  bad |= gemm(GEMM_COL_MAJOR, GEMM_NO_TRANS, GEMM_NO_TRANS, N, M, K, 1, bt,
+      N, A[0], K, 0, c3, N);
+
+  // C written into rows 1 to M and columns 1 to N of big
+  for (i = 0; i < M + 1; i++)
+    for (j = 0; j < N + 2; j++)
+      big[i][j] = -1;
+  bad |= gemm(GEMM_ROW_MAJOR, GEMM_NO_TRANS, GEMM_NO_TRANS, M, N, K, 1, A[0],
+      K, B[0], N, 0, &big[1][1], N + 2);
+
+  for (i = 0; i < M; i++)
+    for (j = 0; j < N; j++)
+      bad |= c2[i][j] != 3 * C[i][j] || c3[i * N + j] != C[i][j] ||
+        big[i + 1][j + 1] != C[i][j] || big[i + 1][0] != -1 ||
+        big[i + 1][N + 1] != -1;
+  for (j = 0; j < N + 2; j++)
+    bad |= big[0][j] != -1;
+
+  // A transpose flag that is neither value is refused, not taken as none
+  bad |= gemm(GEMM_ROW_MAJOR, 2, GEMM_NO_TRANS, M, N, K, 1, A[0], K, B[0],
+      N, 0, c2[0], N) != -1;
+  return bad;
+}
+
 // Passing multidimensional arrays of arbitrary depth is hard
 /*void print_matrix(int ** matrix, int rows, int cols){
   int i, j;
@@ -106,6 +316,8 @@ int main(){
     printf("\n");
   }
 
+  printf("\nGEMM check: %s\n", check_gemm() ? "FAILED" : "ok");
+
   pthread_exit(NULL);
   return 0;
 }
@@ -0,0 +1,153 @@
+/* Project 3: Producer-Consumer Project (pipeline-demo.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Runs a parse -> transform -> write pipeline over generated records:
+ *   pipeline-demo.x [-w mode] [-q capacity] [-t threads] <num records>
+ *
+ * The main thread produces each record as text. parse turns the text into
+ * a number, transform does a fixed amount of arithmetic on it, and write
+ * folds the results into a checksum, which is checked against the same
+ * work done without the pipeline. -t gives the threads of each stage as a
+ * comma-separated list (default 1,1,1), -q the capacity of every buffer
+ * (default 64), and -w the wait mode as for producer-consumer.x. The report
+ * shows how busy each stage was, so the bottleneck can be given more
+ * threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "pipeline.h"
+
+#define NUM_STAGES 3
+#define TRANSFORM_ROUNDS 2000 // Work per record in transform
+
+struct record {
+  char text[24];
+  long value;
+  unsigned long result;
+};
+
+static unsigned long checksum;
+
+static unsigned long transform_value(long value){
+  unsigned long x = value * 2654435761UL + 1;
+  int i;
+
+  for (i = 0; i < TRANSFORM_ROUNDS; i++){
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return x;
+}
+
+static void *parse(void *item, void *arg){
+  struct record *r = item;
+  (void)arg;
+  r->value = strtol(r->text, NULL, 10);
+  return r;
+}
+
+static void *transform(void *item, void *arg){
+  struct record *r = item;
+  (void)arg;
+  r->result = transform_value(r->value);
+  return r;
+}
+
+// Sums are independent of the order the records arrive in
+static void *write_record(void *item, void *arg){
+  struct record *r = item;
+  (void)arg;
+  __atomic_add_fetch(&checksum, r->result, __ATOMIC_RELAXED);
+  free(r);
+  return NULL;
+}
+
+// Parse "a,b,c" into threads. Returns 0 on success, 1 on failure.
+static int parse_threads(const char *list, int *threads){
+  char *end;
+  int i;
+
+  for (i = 0; i < NUM_STAGES; i++){
+    threads[i] = strtol(list, &end, 10);
+    if (threads[i] < 1 || (*end != (i + 1 < NUM_STAGES ? ',' : '\0')))
+      return 1;
+    list = end + 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  struct pipeline p;
+  struct record *r;
+  int threads[NUM_STAGES] = { 1, 1, 1 };
+  int opt, mode = WAIT_ADAPTIVE, capacity = 64;
+  unsigned long expected = 0;
+  long n, i;
+
+  while ((opt = getopt(argc, argv, "q:t:w:")) != -1){
+    switch (opt){
+      case 'q':
+        capacity = strtol(optarg, NULL, 0);
+        if (capacity < 1){
+          printf("ERROR: Capacity must be at least one.\n");
+          exit(1);
+        }
+        break;
+      case 't':
+        if (parse_threads(optarg, threads)){
+          printf("ERROR: Threads must be %d positive counts, as in 1,4,1.\n",
+              NUM_STAGES);
+          exit(1);
+        }
+        break;
+      case 'w':
+        mode = parse_wait_mode(optarg);
+        if (mode < 0){
+          printf("ERROR: Wait mode must be busy, adaptive or blocking.\n");
+          exit(1);
+        }
+        break;
+      default:
+        exit(1);
+    }
+  }
+
+  if (argc - optind != 1){
+    printf("ERROR: Provide the number of records.\n");
+    exit(1);
+  }
+  n = strtol(argv[optind], NULL, 0);
+
+  pipeline_init(&p, capacity, mode);
+  if (pipeline_stage(&p, "parse", parse, NULL, threads[0]) ||
+      pipeline_stage(&p, "transform", transform, NULL, threads[1]) ||
+      pipeline_stage(&p, "write", write_record, NULL, threads[2]) ||
+      pipeline_start(&p)){
+    printf("ERROR: Could not start the pipeline.\n");
+    exit(1);
+  }
+
+  for (i = 0; i < n; i++){
+    r = malloc(sizeof(struct record));
+    if (r == NULL){
+      printf("ERROR: Out of memory.\n");
+      break;
+    }
+    snprintf(r->text, sizeof(r->text), "%ld", i);
+    pipeline_put(&p, r);
+  }
+  pipeline_finish(&p);
+
+  for (i = 0; i < n; i++)
+    expected += transform_value(i);
+  printf("Checksum %lx, %s\n", checksum,
+      checksum == expected ? "as expected" : "WRONG");
+  pipeline_report(&p);
+  pipeline_free(&p);
+  return checksum != expected;
+}
@@ -0,0 +1,274 @@
+/* Project 3: Producer-Consumer Project (pipeline.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Pipeline of stages joined by bounded buffers, each buffer the same
+ * mutex-and-semaphores ring as the producer-consumer buffer. The caller
+ * puts items into the first buffer; the threads of stage i take items from
+ * buffer i and put their results into buffer i + 1.
+ *
+ * End of stream is one extra token posted on a buffer's full semaphore
+ * after its last item. A thread that takes the token while the buffer is
+ * empty posts it again for its siblings and exits; the last thread of a
+ * stage to exit closes the stage's output the same way, so the end flows
+ * down the pipeline behind the last item and every thread can be joined.
+ *
+ * Every thread times how long it runs the stage's function, waits for
+ * input and waits for room in the next buffer. The report gives these as
+ * a share of the stage's thread time: the stage busiest for its thread
+ * count is the bottleneck, and a stage feeding it spends its time blocked.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pipeline.h"
+
+static unsigned long long now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns 0 on success, 1 on failure
+static int pq_init(struct pqueue *q, int size, int mode){
+  q->slots = malloc(size * sizeof(void *));
+  if (q->slots == NULL)
+    return 1;
+  pthread_mutex_init(&q->mutex, NULL);
+  csem_init(&q->empty, size, mode, 0); // All of buffer is empty
+  csem_init(&q->full, 0, mode, 0);
+  q->size = size;
+  q->count = q->in = q->out = 0;
+  return 0;
+}
+
+// Insert item into q, waiting while it is full
+static void pq_put(struct pqueue *q, void *item){
+  csem_wait(&q->empty);
+  pthread_mutex_lock(&q->mutex);
+  q->slots[q->in] = item;
+  q->in = (q->in + 1) % q->size;
+  q->count++;
+  pthread_mutex_unlock(&q->mutex);
+  csem_post(&q->full);
+}
+
+// Remove the next item of q into item, waiting while it is empty.
+// Returns 0 if successful, 1 at end of stream.
+static int pq_get(struct pqueue *q, void **item){
+  csem_wait(&q->full);
+  pthread_mutex_lock(&q->mutex);
+
+  // Only the token of pq_close() is left; leave it for the next thread
+  if (q->count == 0){
+    pthread_mutex_unlock(&q->mutex);
+    csem_post(&q->full);
+    return 1;
+  }
+
+  *item = q->slots[q->out];
+  q->out = (q->out + 1) % q->size;
+  q->count--;
+  pthread_mutex_unlock(&q->mutex);
+  csem_post(&q->empty);
+  return 0;
+}
+
+// Mark the end of stream after the last item put into q
+static void pq_close(struct pqueue *q){
+  csem_post(&q->full);
+}
+
+static void *run_stage(void *param){
+  struct stage_thread *t = param;
+  struct stage *s = t->stage;
+  unsigned long long t0, t1;
+  void *item;
+  int eos;
+
+  for (;;){
+    t0 = now_ns();
+    eos = pq_get(s->in, &item);
+    t1 = now_ns();
+    t->starved_ns += t1 - t0;
+    if (eos)
+      break;
+
+    item = s->fn(item, s->arg);
+    t0 = now_ns();
+    t->busy_ns += t0 - t1;
+    t->items++;
+
+    if (item && s->out){
+      pq_put(s->out, item);
+      t->blocked_ns += now_ns() - t0;
+    }
+  }
+
+  // The last thread out passes the end of stream on
+  if (__atomic_sub_fetch(&s->running, 1, __ATOMIC_SEQ_CST) == 0 && s->out)
+    pq_close(s->out);
+  return NULL;
+}
+
+/* Function to prepare empty pipeline p (arg 1), whose buffers will hold
+ * capacity (arg 2) items each, and whose threads wait in wait mode mode
+ * (arg 3).
+ */
+void pipeline_init(struct pipeline *p, int capacity, int mode){
+  memset(p, 0, sizeof(*p));
+  p->capacity = capacity;
+  p->mode = mode;
+}
+
+/* Function to add a stage named name (arg 2) to the end of pipeline p,
+ * running fn (arg 3) with arg (arg 4) on each item in threads (arg 5)
+ * threads. Stages are added before pipeline_start().
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int pipeline_stage(struct pipeline *p, const char *name, stage_fn fn,
+    void *arg, int threads){
+  struct stage *grown, *s;
+
+  if (threads < 1)
+    return 1;
+  grown = realloc(p->stages, (p->nstages + 1) * sizeof(struct stage));
+  if (grown == NULL)
+    return 1;
+  p->stages = grown;
+
+  s = &p->stages[p->nstages++];
+  memset(s, 0, sizeof(*s));
+  s->name = name;
+  s->fn = fn;
+  s->arg = arg;
+  s->nthreads = threads;
+  return 0;
+}
+
+/* Function to create the buffers and start the threads of every stage of
+ * pipeline p. If a thread cannot be created, the threads started so far
+ * are shut down again.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int pipeline_start(struct pipeline *p){
+  struct stage *s;
+  int i, j;
+
+  if (p->nstages == 0)
+    return 1;
+  p->queues = calloc(p->nstages, sizeof(struct pqueue));
+  if (p->queues == NULL)
+    return 1;
+  for (i = 0; i < p->nstages; i++){
+    s = &p->stages[i];
+    if (pq_init(&p->queues[i], p->capacity, p->mode) ||
+        posix_memalign((void **)&s->threads, CACHE_LINE,
+          s->nthreads * sizeof(struct stage_thread)))
+      return 1; // pipeline_free() releases what was allocated
+    memset(s->threads, 0, s->nthreads * sizeof(struct stage_thread));
+    s->in = &p->queues[i];
+    s->out = i + 1 < p->nstages ? &p->queues[i + 1] : NULL;
+    s->running = s->nthreads;
+  }
+
+  p->started_ns = now_ns();
+  for (i = 0; i < p->nstages; i++){
+    s = &p->stages[i];
+    for (j = 0; j < s->nthreads; j++){
+      s->threads[j].stage = s;
+      if (pthread_create(&s->threads[j].thread, NULL, run_stage,
+            &s->threads[j]) == 0)
+        continue;
+
+      // Shut down the threads that exist; none has seen an item yet
+      __atomic_store_n(&s->running, j, __ATOMIC_SEQ_CST);
+      s->nthreads = j;
+      s->out = NULL;
+      for (i++; i < p->nstages; i++)
+        p->stages[i].nthreads = 0;
+      pipeline_finish(p);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Put item into the first stage's buffer, waiting while it is full
+void pipeline_put(struct pipeline *p, void *item){
+  unsigned long long t0 = now_ns();
+  pq_put(&p->queues[0], item);
+  p->put_blocked_ns += now_ns() - t0;
+}
+
+/* Function to end the stream of items into pipeline p and wait until every
+ * stage has processed everything and its threads have exited.
+ */
+void pipeline_finish(struct pipeline *p){
+  int i, j;
+
+  if (p->nstages)
+    pq_close(&p->queues[0]);
+  for (i = 0; i < p->nstages; i++)
+    for (j = 0; j < p->stages[i].nthreads; j++)
+      pthread_join(p->stages[i].threads[j].thread, NULL);
+  p->finished_ns = now_ns();
+}
+
+// Print the items and utilization of every stage of finished pipeline p,
+// and name the bottleneck
+void pipeline_report(struct pipeline *p){
+  unsigned long long wall = p->finished_ns - p->started_ns;
+  unsigned long long busy, starved, blocked;
+  unsigned long items;
+  struct stage *s;
+  double total, util, worst = -1;
+  const char *bottleneck = NULL;
+  int i, j;
+
+  if (wall == 0)
+    wall = 1;
+  printf("Pipeline ran %.3f seconds; source blocked %.1f%% of the time\n",
+      wall / 1e9, 100.0 * p->put_blocked_ns / wall);
+  printf("stage          threads       items    busy  starved  blocked\n");
+  for (i = 0; i < p->nstages; i++){
+    s = &p->stages[i];
+    items = 0;
+    busy = starved = blocked = 0;
+    for (j = 0; j < s->nthreads; j++){
+      items += s->threads[j].items;
+      busy += s->threads[j].busy_ns;
+      starved += s->threads[j].starved_ns;
+      blocked += s->threads[j].blocked_ns;
+    }
+
+    total = (double)wall * s->nthreads;
+    util = busy / total;
+    printf("%-14s %7d %11lu %6.1f%% %7.1f%% %7.1f%%\n", s->name, s->nthreads,
+        items, 100 * util, 100 * starved / total, 100 * blocked / total);
+    if (util > worst){
+      worst = util;
+      bottleneck = s->name;
+    }
+  }
+  if (bottleneck && worst > 0)
+    printf("Bottleneck: %s (busiest per thread); give it more threads\n",
+        bottleneck);
+}
+
+// Release the buffers and stages of finished pipeline p
+void pipeline_free(struct pipeline *p){
+  int i;
+
+  for (i = 0; p->queues && i < p->nstages; i++)
+    free(p->queues[i].slots); // calloc() left unused ones NULL
+  for (i = 0; i < p->nstages; i++)
+    free(p->stages[i].threads);
+  free(p->queues);
+  free(p->stages);
+  memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,68 @@
+/* Project 3: Producer-Consumer Project (pipeline.h)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Provides a pipeline of stages joined by bounded buffers. Each stage runs
+ * its function on every item in as many threads as it is given. A full
+ * buffer blocks the stage feeding it, so a slow stage holds back everything
+ * before it instead of letting work pile up.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include "sync.h"
+
+// Work of a stage on one item, given the stage's arg. Returns the item to
+// pass on, which need not be the same one, or NULL to drop it. Whatever the
+// last stage returns is dropped, so it must dispose of its items itself.
+typedef void *(*stage_fn)(void *item, void *arg);
+
+// Bounded buffer of items between two stages
+struct pqueue {
+  pthread_mutex_t mutex;
+  csem_t full, empty;
+  void **slots;
+  int size, count, in, out;
+};
+
+// One thread of a stage and where its time went
+struct stage_thread {
+  pthread_t thread;
+  struct stage *stage;
+  unsigned long items;
+  unsigned long long busy_ns;     // Running the stage's function
+  unsigned long long starved_ns;  // Waiting for an item
+  unsigned long long blocked_ns;  // Waiting for room in the next buffer
+} __attribute__((aligned(CACHE_LINE)));
+
+struct stage {
+  const char *name;
+  stage_fn fn;
+  void *arg;
+  int nthreads;
+  int running;                // Threads that have not seen end of stream
+  struct pqueue *in, *out;    // out is NULL for the last stage
+  struct stage_thread *threads;
+};
+
+struct pipeline {
+  struct stage *stages;
+  int nstages;
+  struct pqueue *queues;      // queues[i] feeds stages[i]
+  int capacity, mode;         // Of every buffer, and how threads wait
+  unsigned long long started_ns, finished_ns;
+  unsigned long long put_blocked_ns; // Caller waiting in pipeline_put()
+};
+
+void pipeline_init(struct pipeline *p, int capacity, int mode);
+int pipeline_stage(struct pipeline *p, const char *name, stage_fn fn,
+    void *arg, int threads);
+int pipeline_start(struct pipeline *p);
+void pipeline_put(struct pipeline *p, void *item);
+void pipeline_finish(struct pipeline *p);
+void pipeline_report(struct pipeline *p);
+void pipeline_free(struct pipeline *p);
+
+#endif
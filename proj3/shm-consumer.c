@@ -0,0 +1,118 @@
+/* Project 3: Producer-Consumer Project (shm-consumer.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Consumer half of the cross-process producer-consumer project. Attaches to
+ * the shared-memory queue (creating it if needed) and runs consumer threads
+ * against it until the sleep time is up. Allow for arguments as:
+ *   shm-consumer.x [-b] [-u] [-w mode] [-n name] <sleep time> <num consumer threads>
+ *
+ * -b, -w behave as in producer-consumer.x. -n names the segment (default
+ * /producer-consumer) and -u removes it on exit. Run shm-producer.x with
+ * the same name to produce the items.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "shmqueue.h"
+
+// Global variables
+shmq_t queue;
+int bench = 0; // Set by -b
+
+// Per-thread data, padded so that counters do not share a cache line
+struct worker {
+  unsigned long items; // Items consumed so far
+  char pad[CACHE_LINE - sizeof(unsigned long)];
+};
+
+void *consumer(void *param);
+
+int main(int argc, char **argv){
+  const char *name = SHMQ_DEFAULT_NAME;
+  int opt, unlink_seg = 0, mode = WAIT_ADAPTIVE;
+
+  while ((opt = getopt(argc, argv, "buw:n:")) != -1){
+    switch (opt){
+      case 'b':
+        bench = 1;
+        break;
+      case 'u':
+        unlink_seg = 1;
+        break;
+      case 'n':
+        name = optarg;
+        break;
+      case 'w':
+        mode = parse_wait_mode(optarg);
+        if (mode < 0){
+          printf("ERROR: Wait mode must be busy, adaptive or blocking.\n");
+          exit(1);
+        }
+        break;
+      default:
+        exit(1);
+    }
+  }
+
+  if (argc - optind != 2){
+    printf("ERROR: Provide exactly two arguments.\n");
+    exit(1);
+  }
+
+  // Retrieve command line arguments
+  const long int stime = strtol(argv[optind], NULL, 0);
+  const long int num_consumer = strtol(argv[optind + 1], NULL, 0);
+
+  // Initialize
+  int i;
+  unsigned long consumed = 0;
+  srand(time(NULL) ^ getpid());
+  if (shmq_attach(&queue, name, mode))
+    exit(1);
+
+  // Create the consumer threads
+  pthread_t consumers[num_consumer];
+  struct worker cw[num_consumer];
+  memset(cw, 0, sizeof(cw));
+  for(i = 0; i < num_consumer; i++)
+    pthread_create(&consumers[i], NULL, consumer, &cw[i]);
+
+  // Sleep before terminating
+  sleep(stime);
+
+  if (bench){
+    for (i = 0; i < num_consumer; i++)
+      consumed += __atomic_load_n(&cw[i].items, __ATOMIC_RELAXED);
+    printf("Consumed %lu items in %ld seconds (%.0f items/sec)\n", consumed,
+        stime, stime > 0 ? consumed / (double)stime : 0.0);
+    printf("Peer recoveries: %u\n", queue.seg->recoveries);
+  }
+
+  if (unlink_seg)
+    shmq_unlink(name);
+  return 0;
+}
+
+void *consumer(void *param){
+  struct worker *w = param;
+  buffer_item item;
+  while(1){
+    if (bench){
+      shmq_remove(&queue, &item);
+      __atomic_add_fetch(&w->items, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    sleep(rand() % 5 + 1); // Sleep randomly between 1 and 5 seconds
+
+    if(shmq_remove(&queue, &item))
+      printf("Error occured\n");
+    else
+      printf("Consumer consumed %d\n", item);
+  }
+}
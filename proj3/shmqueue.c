@@ -0,0 +1,189 @@
+/* Project 3: Producer-Consumer Project (shmqueue.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Bounded buffer in a named shared-memory segment. The ring is guarded by a
+ * robust, process-shared mutex, and blocked peers wait on futex words that
+ * count inserts and removes. An insert or remove takes effect with a single
+ * store to in or out, so when a peer dies holding the mutex the next process
+ * to lock it finds the ring intact and only has to wake everyone up.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmqueue.h"
+
+#define SHMQ_MAGIC 0x53484d51   // "SHMQ"
+#define ATTACH_TRIES 500        // Polls of 10 ms for the creator to finish
+
+static uint32_t count(struct shmq_seg *s){
+  return (s->in + 2 * BUFFER_SIZE - s->out) % (2 * BUFFER_SIZE);
+}
+
+// Lock the segment, recovering it if the previous owner died
+static void lock(shmq_t *q){
+  struct shmq_seg *s = q->seg;
+
+  if (pthread_mutex_lock(&s->mutex) == EOWNERDEAD){
+    // The dead peer may have committed an item without bumping the
+    // counters, so bump both and wake every waiter to recheck.
+    pthread_mutex_consistent(&s->mutex);
+    s->recoveries++;
+    __atomic_add_fetch(&s->inserted, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&s->removed, 1, __ATOMIC_SEQ_CST);
+    wake_on(&s->inserted, &s->want_item, INT_MAX, &q->wp);
+    wake_on(&s->removed, &s->want_slot, INT_MAX, &q->wp);
+  }
+}
+
+// Set up the mutex of a freshly created (zero-filled) segment
+static int init_seg(struct shmq_seg *s){
+  pthread_mutexattr_t attr;
+
+  if (pthread_mutexattr_init(&attr) ||
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+      pthread_mutex_init(&s->mutex, &attr))
+    return -1;
+  pthread_mutexattr_destroy(&attr);
+
+  s->size = BUFFER_SIZE;
+  __atomic_store_n(&s->magic, SHMQ_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Function to attach to the queue in shared-memory segment name (arg 2),
+ * creating it if it does not exist yet. Waiting uses wait mode (arg 3).
+ *
+ * Returns 0 when successful, -1 for failure.
+ */
+int shmq_attach(shmq_t *q, const char *name, int mode){
+  struct shmq_seg *s;
+  struct stat st;
+  int fd, created = 1, tries;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1 && errno == EEXIST){
+    created = 0;
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd == -1){
+    printf("ERROR: Could not open shared memory %s\n", name);
+    return -1;
+  }
+
+  if (created && ftruncate(fd, sizeof(struct shmq_seg))){
+    printf("ERROR: Could not size shared memory %s\n", name);
+    close(fd);
+    return -1;
+  }
+
+  // Another process created the segment; wait until it has been sized
+  for (tries = 0; !created; tries++){
+    if (fstat(fd, &st) || tries == ATTACH_TRIES){
+      printf("ERROR: Shared memory %s was never set up\n", name);
+      close(fd);
+      return -1;
+    }
+    if (st.st_size >= (off_t)sizeof(struct shmq_seg))
+      break;
+    usleep(10000);
+  }
+
+  s = mmap(NULL, sizeof(struct shmq_seg), PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  close(fd);
+  if (s == MAP_FAILED){
+    printf("ERROR: Could not map shared memory %s\n", name);
+    return -1;
+  }
+  q->seg = s;
+  wait_init(&q->wp, mode, 1);
+
+  if (created){
+    if (init_seg(s) == 0)
+      return 0;
+    printf("ERROR: Could not initialize shared memory %s\n", name);
+    shmq_detach(q);
+    return -1;
+  }
+
+  for (tries = 0; __atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHMQ_MAGIC;
+      tries++){
+    if (tries == ATTACH_TRIES){
+      printf("ERROR: Shared memory %s was never set up; remove it and retry\n",
+          name);
+      shmq_detach(q);
+      return -1;
+    }
+    usleep(10000);
+  }
+  if (s->size != BUFFER_SIZE){
+    printf("ERROR: Shared memory %s holds a queue of a different size\n", name);
+    shmq_detach(q);
+    return -1;
+  }
+
+  return 0;
+}
+
+void shmq_detach(shmq_t *q){
+  munmap(q->seg, sizeof(struct shmq_seg));
+  q->seg = NULL;
+}
+
+// Removes the segment name; processes still attached keep their mapping.
+int shmq_unlink(const char *name){
+  return shm_unlink(name);
+}
+
+// Insert item into the queue, waiting while it is full. Returns 0.
+int shmq_insert(shmq_t *q, buffer_item item){
+  struct shmq_seg *s = q->seg;
+  uint32_t seen;
+
+  lock(q);
+  while (count(s) == BUFFER_SIZE){
+    seen = s->removed;
+    pthread_mutex_unlock(&s->mutex);
+    wait_on(&s->removed, seen, &s->want_slot, &q->wp);
+    lock(q);
+  }
+
+  s->buffer[s->in % BUFFER_SIZE] = item;
+  __atomic_store_n(&s->in, (s->in + 1) % (2 * BUFFER_SIZE), __ATOMIC_RELEASE);
+  __atomic_add_fetch(&s->inserted, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&s->mutex);
+  wake_on(&s->inserted, &s->want_item, 1, &q->wp);
+  return 0;
+}
+
+// Remove an item from the queue into item, waiting while it is empty.
+// Returns 0.
+int shmq_remove(shmq_t *q, buffer_item *item){
+  struct shmq_seg *s = q->seg;
+  uint32_t seen;
+
+  lock(q);
+  while (count(s) == 0){
+    seen = s->inserted;
+    pthread_mutex_unlock(&s->mutex);
+    wait_on(&s->inserted, seen, &s->want_item, &q->wp);
+    lock(q);
+  }
+
+  *item = s->buffer[s->out % BUFFER_SIZE];
+  __atomic_store_n(&s->out, (s->out + 1) % (2 * BUFFER_SIZE), __ATOMIC_RELEASE);
+  __atomic_add_fetch(&s->removed, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&s->mutex);
+  wake_on(&s->removed, &s->want_slot, 1, &q->wp);
+  return 0;
+}
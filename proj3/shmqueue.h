@@ -0,0 +1,46 @@
+/* Project 3: Producer-Consumer Project (shmqueue.h)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Provides header for shmqueue.c, a bounded buffer that lives in a named
+ * shared-memory segment so that producers and consumers may run as
+ * separate processes.
+ */
+
+#ifndef SHMQUEUE_H
+#define SHMQUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "sync.h"
+
+#define SHMQ_DEFAULT_NAME "/producer-consumer"
+
+// Layout of the shared segment
+struct shmq_seg {
+  uint32_t magic;          // SHMQ_MAGIC once the creator is done
+  uint32_t size;           // BUFFER_SIZE of the creator
+  pthread_mutex_t mutex;   // Robust and process-shared
+  uint32_t in, out;        // Positions modulo 2 * BUFFER_SIZE
+  uint32_t inserted;       // Bumped on every insert; consumers wait on it
+  uint32_t removed;        // Bumped on every remove; producers wait on it
+  uint32_t want_item;      // Consumers parked on inserted
+  uint32_t want_slot;      // Producers parked on removed
+  uint32_t recoveries;     // Times a peer died holding the mutex
+  buffer_item buffer[BUFFER_SIZE];
+};
+
+// A process's handle on an attached segment
+typedef struct {
+  struct shmq_seg *seg;
+  waitpolicy_t wp;
+} shmq_t;
+
+int shmq_attach(shmq_t *q, const char *name, int mode);
+void shmq_detach(shmq_t *q);
+int shmq_unlink(const char *name);
+int shmq_insert(shmq_t *q, buffer_item item);
+int shmq_remove(shmq_t *q, buffer_item *item);
+
+#endif
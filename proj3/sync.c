@@ -0,0 +1,158 @@
+/* Project 3: Producer-Consumer Project (sync.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Futex-based waiting primitives. A thread that must wait for a word to
+ * change first spins with pause instructions, then yields its time slice, and
+ * only then parks in the kernel. The spin limit adapts to how long waits
+ * have recently taken, so short handoffs never pay for a syscall while long
+ * waits do not burn CPU.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "sync.h"
+
+#define SPIN_MIN 16       // Adaptive spin limit bounds, in pause iterations
+#define SPIN_MAX 16384
+#define YIELD_ROUNDS 4    // Calls to sched_yield() before parking
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+// Spinning cannot help when the thread we wait for cannot run meanwhile
+static int uniprocessor = 0;
+
+static void futex_wait(uint32_t *word, uint32_t val, int shared){
+  syscall(SYS_futex, word, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val,
+      NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word, int n, int shared){
+  syscall(SYS_futex, word, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, n,
+      NULL, NULL, 0);
+}
+
+// Move the spin limit towards twice the spins the last wait needed, or
+// shrink it when spinning did not pay off.
+static void tune(waitpolicy_t *wp, uint32_t spins, int success){
+  uint32_t limit = __atomic_load_n(&wp->spin, __ATOMIC_RELAXED);
+
+  if (success)
+    limit = (int32_t)limit + ((int32_t)(2 * spins + SPIN_MIN) - (int32_t)limit) / 8;
+  else
+    limit -= limit / 8;
+
+  if (limit < SPIN_MIN)
+    limit = SPIN_MIN;
+  if (limit > SPIN_MAX)
+    limit = SPIN_MAX;
+  __atomic_store_n(&wp->spin, limit, __ATOMIC_RELAXED);
+}
+
+// Returns the wait mode named by name, or -1 if it is not recognized
+int parse_wait_mode(const char *name){
+  if (!strcmp(name, "busy"))
+    return WAIT_BUSY;
+  if (!strcmp(name, "adaptive"))
+    return WAIT_ADAPTIVE;
+  if (!strcmp(name, "blocking"))
+    return WAIT_BLOCKING;
+  return -1;
+}
+
+const char *wait_mode_name(int mode){
+  switch (mode){
+    case WAIT_BUSY:     return "busy";
+    case WAIT_ADAPTIVE: return "adaptive";
+    default:            return "blocking";
+  }
+}
+
+void wait_init(waitpolicy_t *wp, int mode, int shared){
+  wp->mode = mode;
+  wp->shared = shared;
+  wp->spin = SPIN_MIN * 8;
+  uniprocessor = sysconf(_SC_NPROCESSORS_ONLN) == 1;
+}
+
+/* Function to wait until *word (arg 1) no longer holds val (arg 2). Threads
+ * that park in the kernel are counted in waiters (arg 3) so that wake_on()
+ * can skip the syscall when nobody sleeps. May return spuriously, so the
+ * caller must recheck its condition.
+ */
+void wait_on(uint32_t *word, uint32_t val, uint32_t *waiters, waitpolicy_t *wp){
+  uint32_t n, limit;
+  int i;
+
+  if (wp->mode == WAIT_BUSY){
+    while (LOAD(word) == val)
+      cpu_relax();
+    return;
+  }
+
+  if (wp->mode == WAIT_ADAPTIVE){
+    limit = uniprocessor ? 0 : __atomic_load_n(&wp->spin, __ATOMIC_RELAXED);
+    for (n = 0; n < limit; n++){
+      if (LOAD(word) != val){
+        tune(wp, n, 1);
+        return;
+      }
+      cpu_relax();
+    }
+
+    for (i = 0; i < YIELD_ROUNDS; i++){
+      sched_yield();
+      if (LOAD(word) != val){
+        tune(wp, limit, 1); // Spinning a little longer would have paid off
+        return;
+      }
+    }
+    tune(wp, limit, 0);
+  }
+
+  __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+  futex_wait(word, val, wp->shared); // Returns at once if *word changed
+  __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+// Wakes up to n (arg 3) threads parked on word, if any are parked.
+void wake_on(uint32_t *word, uint32_t *waiters, int n, waitpolicy_t *wp){
+  if (LOAD(waiters))
+    futex_wake(word, n, wp->shared);
+}
+
+void csem_init(csem_t *s, uint32_t value, int mode, int shared){
+  s->value = value;
+  s->waiters = 0;
+  wait_init(&s->wp, mode, shared);
+}
+
+// Takes a token without waiting. Returns 1 if one was taken, 0 otherwise.
+int csem_trywait(csem_t *s){
+  uint32_t v = LOAD(&s->value);
+
+  while (v > 0)
+    if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 0,
+          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return 1;
+  return 0;
+}
+
+void csem_wait(csem_t *s){
+  while (!csem_trywait(s))
+    wait_on(&s->value, 0, &s->waiters, &s->wp);
+}
+
+void csem_post(csem_t *s){
+  __atomic_add_fetch(&s->value, 1, __ATOMIC_SEQ_CST);
+  wake_on(&s->value, &s->waiters, 1, &s->wp);
+}
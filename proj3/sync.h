@@ -0,0 +1,50 @@
+/* Project 3: Producer-Consumer Project (sync.h)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Provides futex-based waiting primitives for the bounded buffer. A blocked
+ * thread may busy-wait, spin briefly before parking in the kernel, or park
+ * right away, depending on the selected wait mode.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+
+#define CACHE_LINE 64 // Bytes; used to keep hot counters apart
+
+// Strategies for a thread that finds the buffer full or empty
+enum wait_mode {
+  WAIT_BUSY,      // Spin until the condition changes, never sleep
+  WAIT_ADAPTIVE,  // Spin, then yield, then park on a futex
+  WAIT_BLOCKING   // Park on a futex immediately
+};
+
+// How to wait on a futex word, shared by everything waiting on it
+typedef struct {
+  int mode;       // One of enum wait_mode
+  int shared;     // Nonzero if the futex words live in shared memory
+  uint32_t spin;  // Spin limit, tuned at runtime by WAIT_ADAPTIVE
+} waitpolicy_t;
+
+// Counting semaphore whose value doubles as the futex word
+typedef struct {
+  uint32_t value;    // Available tokens
+  uint32_t waiters;  // Threads parked in the kernel on value
+  waitpolicy_t wp;
+} csem_t;
+
+int parse_wait_mode(const char *name);
+const char *wait_mode_name(int mode);
+
+void wait_init(waitpolicy_t *wp, int mode, int shared);
+void wait_on(uint32_t *word, uint32_t val, uint32_t *waiters, waitpolicy_t *wp);
+void wake_on(uint32_t *word, uint32_t *waiters, int n, waitpolicy_t *wp);
+
+void csem_init(csem_t *s, uint32_t value, int mode, int shared);
+int csem_trywait(csem_t *s);
+void csem_wait(csem_t *s);
+void csem_post(csem_t *s);
+
+#endif
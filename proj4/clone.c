@@ -7,307 +7,1161 @@
  * destination directory using the UNIX API. All files that already exist in
  * the destination directory but that are not found in the source will be
  * removed.
+ *   clone.x [-i] [-c] [-s] [-d MB] [-j jobs] [-u [-q depth]] [-r journal]
+ *           [--direct MB] [--filter rules] [--verify] <source> <dest>
+ *
+ * -j copies with the given number of worker threads. Directories are still
+ * created before their contents, and their attributes are set after.
+ *
+ * -i makes the clone incremental: files whose copy already has the same size
+ * and modification time are left alone. -c decides by comparing contents
+ * instead of modification times (and implies -i).
+ *
+ * -d updates files of at least the given number of megabytes in place when
+ * a copy already exists, rewriting only the blocks that changed.
+ *
+ * -u moves file data through io_uring, keeping up to depth (-q, default 32)
+ * files in flight from a single thread. Without io_uring support in the
+ * kernel, files are copied synchronously as usual.
+ *
+ * -r makes the clone resumable. Files are written under temporary names and
+ * renamed into place once complete, and a journal records what is finished
+ * and durable. Running the same clone with the same journal after a crash
+ * skips everything it records; the journal is removed on success.
+ *
+ * --direct copies files of at least the given number of megabytes with
+ * O_DIRECT, so that cloning huge files does not evict the page cache of
+ * everything else on the host. Such files are copied synchronously even
+ * with -u; sparse files and filesystems without O_DIRECT are copied as
+ * usual.
+ *
+ * --filter reads include and exclude rules from a file (see filter.c).
+ * Excluded entries are neither copied nor pruned: excluded directories are
+ * never opened, and what the destination holds under excluded names is left
+ * alone.
+ *
+ * --verify checks every file copied against its source with a CRC32C
+ * checksum, failing the clone on a mismatch. The source's checksum is taken
+ * while the data is copied where possible, so mostly the copy alone is read
+ * back; files skipped as unchanged are not checked.
+ *
+ * -s replaces the line printed for every file and directory with a progress
+ * line on stderr, and ends with a report of rates, system calls and the time
+ * threads spent traversing, copying data, applying metadata and pruning.
+ *
+ * Directories are read and written through open descriptors, with every
+ * entry named relative to its directory, so paths may be of any length.
+ * Files and directories keep their owner, permissions, times and extended
+ * attributes (ACLs included), and symbolic links are copied as links.
+ * Files with several hard links in the source are copied once; their other
+ * names are linked to that copy.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
+#include <stdarg.h>
+#include <getopt.h>
 #include <errno.h>
+#include "clone.h"
+
+static int incremental;   // -i: skip files whose copy is up to date
+static int compare;       // -c: compare contents rather than times for -i
+static int use_uring;     // -u: copy file data through io_uring
+static off_t delta_min;   // -d: smallest file to update in place, or 0
+static int show_stats;    // -s: progress and statistics instead of messages
+static const char *journal_file; // -r: journal of a resumable clone
+
+// Options without a short form
+#define OPT_VERIFY 256
+#define OPT_DIRECT 257
+#define OPT_FILTER 258
+static const struct option long_opts[] = {
+  { "direct", required_argument, NULL, OPT_DIRECT },
+  { "filter", required_argument, NULL, OPT_FILTER },
+  { "verify", no_argument, NULL, OPT_VERIFY },
+  { NULL, 0, NULL, 0 }
+};
+
+
+void show_perms(const char*, const char*, const struct stat*);
+static void make_link(struct task*, struct hardlink*);
+int clone(const char*, const char*, int, int, int, int);
+int clone_recursive(struct dnode*);
+int remove_files(int, int, const char*, const char*);
+int remove_tree(int, const char*, unsigned char, const char*);
+
+// Prints a message about one file or directory, unless -s is in use
+static void say(const char *fmt, ...){
+  va_list args;
 
-#define BUF_LEN 80
-#define BLOCKSIZE 4096
+  if (show_stats)
+    return;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+// Directories keep their descriptors open until everything inside them is
+// done, so allow as many open files as the hard limit permits.
+static void raise_fd_limit(void){
+  struct rlimit rl;
 
-int set_perms(const char*, const char*);
-int clone(char*, char*);
-int clone_recursive(char*, char*,  char*);
-int copy(char*, char*);
-int remove_files(char*, char*);
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
 
 int main(int argc, char **argv){
-  const char* src = argv[1];  // Source directory, relative or absolute
-  const char* dst = argv[2];  // Destination directory
-  char src_abs[BUF_LEN];      // Absolute source path
-  char dst_abs[BUF_LEN];      // Absolute destination path
-  char init_abs[BUF_LEN];     // Absolute path of execution directory
+  const char* src;            // Source directory, relative or absolute
+  const char* dst;            // Destination directory
+  int src_fd, dst_fd;         // Both directories, opened once
+  struct stat src_st, dst_st;
   int mktarget = 0;           // Indicates if the destination dir is created
+  int jobs = 1;               // Worker threads copying files
+  int depth = 32;             // Files in flight with -u
+  int opt;
 
-  if (argc != 3){
-    printf("clone.x <source> <dest>\n");
-    exit(1);
+  while ((opt = getopt_long(argc, argv, "cd:ij:q:r:su", long_opts, NULL))
+      != -1){
+    switch (opt){
+      case 'd':
+        delta_min = strtoll(optarg, NULL, 0) * 1024 * 1024;
+        if (delta_min < 1){
+          printf("ERROR: -d needs a size of at least 1 MB.\n");
+          exit(1);
+        }
+        break;
+      case 'c':
+        compare = 1;
+        incremental = 1;
+        break;
+      case 'i':
+        incremental = 1;
+        break;
+      case 'j':
+        jobs = strtol(optarg, NULL, 0);
+        if (jobs < 1){
+          printf("ERROR: -j needs at least one job.\n");
+          exit(1);
+        }
+        break;
+      case 'q':
+        depth = strtol(optarg, NULL, 0);
+        if (depth < 1){
+          printf("ERROR: -q needs a queue depth of at least one.\n");
+          exit(1);
+        }
+        break;
+      case 'r':
+        journal_file = optarg;
+        break;
+      case 's':
+        show_stats = 1;
+        break;
+      case 'u':
+        use_uring = 1;
+        break;
+      case OPT_DIRECT:
+        direct_min = strtoll(optarg, NULL, 0) * 1024 * 1024;
+        if (direct_min < 1){
+          printf("ERROR: --direct needs a size of at least 1 MB.\n");
+          exit(1);
+        }
+        break;
+      case OPT_FILTER:
+        if (filter_load(optarg)){
+          printf("ERROR: could not read filter rules from %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case OPT_VERIFY:
+        verify_copies = 1;
+        break;
+      default:
+        exit(1);
+    }
   }
 
-  if(!strncmp(src, dst, BUF_LEN))
-    exit(0); // Can this be handled somewhere else?
+  if (argc - optind != 2){
+    printf("clone.x [-i] [-c] [-s] [-d MB] [-j jobs] [-u [-q depth]] "
+        "[-r journal] [--direct MB] [--filter rules] [--verify] "
+        "<source> <dest>\n");
+    exit(1);
+  }
+  src = argv[optind];
+  dst = argv[optind + 1];
 
-  getcwd(init_abs, BUF_LEN); // Record absolute path of initial directory
+  stats_start(show_stats);
+  if (verify_copies)
+    verify_init();
 
   // First check if source directory exists
-  if (chdir(src)){
+  src_fd = open(src, O_RDONLY | O_DIRECTORY);
+  if (src_fd == -1){
     printf("%s is not a valid source directory.\n", src);
     exit(1);
   }
-  getcwd(src_abs, BUF_LEN); // Record absolute path for source
 
-  // Return to previous directory and check for destination directory
-  chdir(init_abs);
-  if(chdir(dst)){ // Destination does not exist
-    if(mkdir(dst, S_IRWXU | S_IRWXG | S_IRWXO)){ // Create new directory
-      printf("ERROR: failed to create destination directory!\n");
-      exit(1);
-    }
+  // Create the destination unless it exists already
+  if (mkdir(dst, S_IRWXU | S_IRWXG | S_IRWXO) == 0){
     mktarget = 1;
-    chdir(dst);
-    getcwd(dst_abs, BUF_LEN); // Record absolute path for destination
-    chdir(init_abs);
-
-    printf("Creating directory %s\n", dst_abs); // Already done, so print msg.
+    say("Creating directory %s\n", dst);
   }
-  else { // Destination exists, so record absolute path
-    getcwd(dst_abs, BUF_LEN);
-    chdir(init_abs);
+  else if (errno != EEXIST){
+    printf("ERROR: failed to create destination directory!\n");
+    exit(1);
   }
-
-  // Set permissions of destination directory
-  if (set_perms(src_abs, dst_abs)){
-    printf("ERROR: failed to set permissions!");
+  dst_fd = open(dst, O_RDONLY | O_DIRECTORY);
+  if (dst_fd == -1 || fstat(src_fd, &src_st) || fstat(dst_fd, &dst_st)){
+    printf("%s is not a valid destination directory.\n", dst);
     exit(1);
   }
+  if (src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino)
+    exit(0); // Source and destination are the same directory
+
+  raise_fd_limit();
+  if (journal_file && journal_open(journal_file, &src_st, &dst_st, dst_fd))
+    exit(1);
 
-  // Start recursive clone by supplying root source and destination
-  if(clone(src_abs, dst_abs)){
+  // Start recursive clone by supplying root source and destination. The
+  // destination's own attributes are set once its contents are done.
+  if(clone(src, dst, src_fd, dst_fd, jobs, depth)){
+    journal_close(0); // Keep what was done for the next attempt
     printf("ERROR: clone failed!\n");
     exit(1);
   }
 
   // Recursively remove existing files from target
-  if(mktarget == 0) // Only necessariy if directory did not need to be created
-    remove_files(src_abs, dst_abs);
+  if(mktarget == 0){ // Only necessariy if directory did not need to be created
+    stats_phase(PH_PRUNE);
+    remove_files(src_fd, dst_fd, src, dst);
+    stats_phase(PH_IDLE);
+  }
+  filter_free();
 
+  if (journal_close(1)){
+    printf("ERROR: clone failed!\n");
+    exit(1);
+  }
+  stats_finish();
   exit(0);
 }
 
-/* Function to copy the attributes of the a source file (arg 1) to a target
- * file (arg 2).
- *
- * Returns 0 when successful, 1 for failure.
+/* Function to report the attributes st (arg 3) given to name (arg 2) in
+ * destination directory dir (arg 1), or to dir itself if name is NULL. The
+ * attributes are applied through open descriptors by set_meta().
  */
-int set_perms(const char* s, const char* dst){
-  struct stat src;  // Holds source attributes
-  stat(s, &src);    // Retrieves source attributes.
+void show_perms(const char* dir, const char* name, const struct stat* st){
+  const char *sep = name ? "/" : "";
 
-  printf("Setting permissions for %s: %o\n", dst, src.st_mode & 07777);
-  if (chmod(dst, src.st_mode))
-    return 1;
+  if (name == NULL)
+    name = "";
+  if (!S_ISLNK(st->st_mode))
+    say("Setting permissions for %s%s%s: %o\n", dir, sep, name,
+        st->st_mode & 07777);
+  say("Setting user and group for %s%s%s: %u, %u\n", dir, sep, name,
+      (unsigned int)st->st_uid, (unsigned int)st->st_gid);
+}
 
-  printf("Setting user and group for %s: %u, %u\n", dst,
-      (unsigned int)src.st_uid, (unsigned int)src.st_gid);
-  if (chown(dst, src.st_uid, src.st_gid))
-    return 1;
+// The destination root, never copied into itself when it lies in the source
+static dev_t abort_dev;
+static ino_t abort_ino;
+static int failed = 0;    // Set once any task fails; later tasks are skipped
 
-  return 0;
+// First copies of hard-linked source files, by source inode
+static struct linkmap links;
+
+static size_t root_len;   // Length of the source root's path
+static const char *root_dst; // Destination root's path
+static int root_fd;       // Destination root, open while the clone runs
+
+static void fail(void){
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+// Returns dir/name in newly allocated memory, or NULL
+static char *join(const char *dir, const char *name){
+  char *path;
+
+  if (asprintf(&path, "%s/%s", dir, name) < 0)
+    return NULL;
+  return path;
 }
 
-/* Wrapper function for recursive clone function. Since it is necessary
- * to keep track of the original destination directory in order to avoid
- * "copying the copy", the true recursive function takes a third argument
- * --the original destination path--that will remain constant throughout
- * recursions. Since the third argument will always be a copy of the second,
- * it is convenient to have this function.
+/* Directory name (arg 2) in parent (arg 1), with source attributes st
+ * (arg 3). Its attributes are applied only after its own scan and
+ * everything inside it have finished, so that a read-only source directory
+ * cannot keep its copy from being filled, and so that each parent is
+ * finished after its children. Its descriptors are opened by the scan.
  */
-int clone(char* src, char* dst){
-  return clone_recursive(src, dst, dst);
+static struct dnode *new_dnode(struct dnode *parent, const char *name,
+    const struct stat *st){
+  struct dnode *d = malloc(sizeof(struct dnode));
+  d->src = parent ? join(parent->src, name) : strdup(name);
+  d->dst = parent ? join(parent->dst, name) : strdup(name);
+  d->name = parent ? strdup(name) : NULL;
+  d->src_fd = d->dst_fd = -1;
+  d->st = *st;
+  d->parent = parent;
+  d->pending = 1; // Released when the scan of d finishes
+  if (parent)
+    __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+  return d;
 }
 
-/* Function to recursively copy files from a source directory (arg 1) to
- * a target directory (arg 2). Provides a check against copying the copy
- * through an abort path (arg 3), representing the original target path.
+// Returns the path of name (arg 2) in dir (arg 1), or of dir itself if name
+// is NULL, relative to the root of the clone. Used as the journal key.
+static char *rel_path(struct dnode *dir, const char *name){
+  return name ? join(dir->src + root_len, name) : strdup(dir->src + root_len);
+}
+
+// Returns 1 if the journal has a record of type (arg 1) for name (arg 3) in
+// dir (arg 2), left by an earlier run of the clone
+static int committed(char type, struct dnode *dir, const char *name){
+  char *rel;
+  int found;
+
+  if (journal_file == NULL)
+    return 0;
+  rel = rel_path(dir, name);
+  found = rel && journal_has(type, rel);
+  free(rel);
+  return found;
+}
+
+/* Function to apply the --filter rules to entry name (arg 3) of the
+ * directory open as dirfd (arg 1), whose path relative to the root of the
+ * clone is rel (arg 2). The entry is looked up only if its type is unknown
+ * and a rule depends on it, in which case type (arg 4) is filled in.
  *
- * Returns 0 on success, 1 on failure.
+ * Returns 1 if the entry is excluded, 0 otherwise.
  */
-int clone_recursive(char* src, char* dst, char* abort){
-  DIR *dirp;                // Represents a directory stream
-  struct dirent *entry;     // Holds a directory entity: d_ino and d_name
-  char src_file[BUF_LEN+1]; // Holds source file path
-  char dst_file[BUF_LEN+1]; // Holds destination file path
-
-  if(!strncmp(src, dst, BUF_LEN))
-    return 0; // Base case of recursive function
-
-  // Open directory stream
-  dirp = opendir(src);
-  if (dirp == NULL){
-    printf("ERROR: Could not open %s\n", src);
-    return 1;
+static int excluded(int dirfd, const char *rel, const char *name,
+    unsigned char *type){
+  struct stat st;
+  int rc = filter_check(rel, name, *type);
+
+  if (rc == FILTER_UNKNOWN){
+    if (stat_at(dirfd, name, &st, 0))
+      return 0; // Left for the caller to report
+    *type = IFTODT(st.st_mode);
+    rc = filter_check(rel, name, *type);
   }
+  return rc == FILTER_SKIP;
+}
 
-  // Iterate through stream
-  for (;;){
-    entry = readdir(dirp);
-    if(entry == NULL)
-      break;
-    if (!strncmp(entry->d_name, "..", 2) || !strncmp(entry->d_name, ".", 1))
-      continue; // Skip ".." and "."
-
-    // Construct absolute path for source and destination
-    snprintf(src_file, BUF_LEN, "%s/%s", src, entry->d_name);
-    snprintf(dst_file, BUF_LEN, "%s/%s", dst, entry->d_name);
-    
-    if (!strncmp(src_file, abort, BUF_LEN))
-      continue;  // Skip if directory is source
-
-    if (entry->d_type & DT_DIR){
-      // Entry is a directory, so recurse
-      printf("Creating directory %s\n", dst_file);
-      // Check to see if directory already exists in destination
-      if(chdir(dst_file)){
-        if(mkdir(dst_file, 0)){
-          printf("ERROR: failed to create directory!\n");
-          return 1;
-        }
-      }
+// Records in the journal that name (arg 3) in dir (arg 2), or dir itself,
+// is complete in the destination and holds bytes (arg 4) of file data
+static void journal_done(char type, struct dnode *dir, const char *name,
+    long long bytes){
+  char *rel;
 
-      set_perms(src_file, dst_file);
+  if (journal_file == NULL)
+    return;
+  rel = rel_path(dir, name);
+  if (rel == NULL || journal_add(type, rel, bytes))
+    fail();
+  free(rel);
+}
 
-      // Clone new directory
-      if(clone_recursive(src_file, dst_file, abort))
-        return 1;
-    }
-    else {
-      // Entry is a file, so copy it to destination
-      printf("Copying %s to %s\n", src_file, dst_file);
-      if(copy(src_file, dst_file)){
-        printf("ERROR: file copy failed!\n");
-        return 1;
-      }
-      if(set_perms(src_file, dst_file)){
-        printf("ERROR: failed to set permissions!");
-        return 1;
+// Records in the journal that t holds the first copy of its inode, so that
+// a resumed clone links the inode's other names to it
+static void journal_first(struct task *t){
+  char *rel, *rec = NULL;
+
+  if (journal_file == NULL)
+    return;
+  rel = rel_path(t->dir, t->name);
+  if (rel == NULL || asprintf(&rec, "%llu:%llu %s",
+        (unsigned long long)t->st.st_dev, (unsigned long long)t->st.st_ino,
+        rel) < 0 || journal_add('L', rec, 0))
+    fail();
+  free(rel);
+  free(rec);
+}
+
+// Releases one pending reference on d. The last one applies the directory's
+// attributes and releases d's reference on its parent in turn.
+static void dir_done(struct dnode *d){
+  struct dnode *parent;
+
+  while (d && __atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0){
+    if (d->src_fd != -1 && d->dst_fd != -1){
+      show_perms(d->dst, NULL, &d->st);
+      if (set_meta(d->src_fd, d->dst_fd, &d->st)){
+        printf("ERROR: failed to set permissions!\n");
+        fail();
       }
+      else if (d->parent && !__atomic_load_n(&failed, __ATOMIC_RELAXED))
+        journal_done('D', d, NULL, 0); // Its whole subtree is finished
     }
+    if (d->src_fd != -1){
+      COUNT_SYS(SYS_DIR);
+      close(d->src_fd);
+    }
+    if (d->dst_fd != -1){
+      COUNT_SYS(SYS_DIR);
+      close(d->dst_fd);
+    }
+    parent = d->parent;
+    free(d->src);
+    free(d->dst);
+    free(d->name);
+    free(d);
+    d = parent;
   }
+}
 
-  // Close directory stream
-  closedir(dirp);
-  return 0;
+// Queues a task of type (arg 1) on dir, for file name with attributes st if
+// they are known already (arg 4, or NULL).
+static void submit(int type, struct dnode *dir, const char *name,
+    const struct stat *st){
+  struct task *t = malloc(sizeof(struct task));
+  t->type = type;
+  t->dir = dir;
+  t->name = name ? strdup(name) : NULL;
+  t->have_st = st != NULL;
+  if (st)
+    t->st = *st;
+  t->tmp = NULL;
+  t->link = NULL;
+  t->next = NULL;
+  pool_submit(t);
+}
 
+/* Function to decide whether the destination already holds a copy of the
+ * file of task t (arg 1): same size and modification time, and with -c the
+ * same contents. The copy's attributes are stored in d (arg 2).
+ *
+ * Returns 1 if the copy can be skipped, 0 otherwise.
+ */
+static int up_to_date(struct task* t, struct stat* d){
+  if (stat_at(t->dir->dst_fd, t->name, d, 0) || !S_ISREG(d->st_mode) ||
+      t->st.st_size != d->st_size)
+    return 0;
+  if (compare)
+    return same_contents(t->dir->src_fd, t->dir->dst_fd, t->name);
+  return t->st.st_mtim.tv_sec == d->st_mtim.tv_sec &&
+    t->st.st_mtim.tv_nsec == d->st_mtim.tv_nsec;
 }
 
+// Gives an unchanged copy, whose attributes are d (arg 2), the owner and
+// permissions of the source of task t if they changed since it was made.
+// Returns 0 on success, 1 on failure.
+static int fix_perms(struct task* t, const struct stat* d){
+  const struct stat *st = &t->st;
+  int old = stats_phase(PH_META), rc = 0;
 
-// Function to copy a file from src to dst.
-// Returns 0 on successful copy, 1 on failure
-int copy(char* src, char* dst){
-  int src_fd, dst_fd;   // Holds src/dst file descriptors
-  char buf[BLOCKSIZE];  // Buffer for data transfer
-  ssize_t nread, nwritten;  // Keep track of bytes written and read
-  char *out_ptr;
+  if (st->st_uid != d->st_uid || st->st_gid != d->st_gid){
+    COUNT_SYS(SYS_META);
+    rc = fchownat(t->dir->dst_fd, t->name, st->st_uid, st->st_gid, 0) != 0;
+  }
+  if (rc == 0 && (st->st_mode & 07777) != (d->st_mode & 07777)){
+    COUNT_SYS(SYS_META);
+    rc = fchmodat(t->dir->dst_fd, t->name, st->st_mode & 07777, 0) != 0;
+  }
 
-  // Open files
-  src_fd = open(src, O_RDONLY);
-  if (src_fd == -1){
-    printf("ERROR: opening source file failed!\n");
+  stats_phase(old);
+  return rc;
+}
+
+// Releases file task t and its reference on the parent directory
+static void release_file(struct task *t){
+  dir_done(t->dir);
+  free(t->name);
+  free(t->tmp);
+  free(t);
+}
+
+/* Function to open the file at rel (arg 2), a path from the root of the
+ * clone, below directory dirfd (arg 1). Each component is opened in turn,
+ * so the path may be longer than PATH_MAX.
+ *
+ * Returns an O_PATH descriptor, or -1.
+ */
+static int open_rel(int dirfd, const char *rel){
+  char *copy = strdup(rel), *name, *next;
+  int fd = dirfd, sub;
+
+  if (copy == NULL)
+    return -1;
+  for (name = copy; name && *name; name = next){
+    next = strchr(name, '/');
+    if (next)
+      *next++ = '\0';
+    if (*name == '\0')
+      continue; // Leading or doubled '/'
+    COUNT_SYS(SYS_OPEN);
+    sub = openat(fd, name, O_PATH | O_NOFOLLOW | (next ? O_DIRECTORY : 0));
+    if (fd != dirfd)
+      close(fd);
+    fd = sub;
+    if (fd == -1)
+      break;
+  }
+  free(copy);
+  return fd == dirfd ? -1 : fd;
+}
+
+// Keeps the first copy of h open as fd (arg 2), an O_PATH descriptor or -1,
+// so that later names are linked to it without a path. Returns the new
+// state of h.
+static int hold_first(struct hardlink *h, int fd){
+  struct stat st;
+
+  if (fd != -1 && fstat(fd, &st) == 0){
+    h->fd = fd;
+    h->dst_dev = st.st_dev;
+    h->dst_ino = st.st_ino;
+    return LINK_DONE;
+  }
+  if (fd != -1)
+    close(fd);
+  printf("ERROR: could not open %s to link to it!\n", h->path);
+  fail();
+  return LINK_FAILED;
+}
+
+// Counts one more name linked to the first copy of h, closing its
+// descriptor once every name has been
+static void put_link(struct hardlink *h){
+  if (__atomic_sub_fetch(&h->left, 1, __ATOMIC_ACQ_REL) == 0){
+    linkmap_lock();
+    close(h->fd);
+    h->fd = -1;
+    linkmap_unlock();
+  }
+}
+
+// Tells the other names of the first copy t of an inode whether it failed,
+// as told by rc, linking those that waited for it
+static void wake_links(struct task *t, int rc){
+  struct hardlink *h = t->link;
+  struct task *w, *next;
+  int fd = -1;
+
+  if (h == NULL)
+    return;
+  if (rc == 0){
+    COUNT_SYS(SYS_OPEN);
+    fd = openat(t->dir->dst_fd, t->name, O_PATH | O_NOFOLLOW);
+  }
+  linkmap_lock();
+  h->state = rc ? LINK_FAILED : hold_first(h, fd);
+  w = h->waiting;
+  h->waiting = NULL;
+  linkmap_unlock();
+  for (; w; w = next){
+    next = w->next;
+    make_link(w, h);
+  }
+}
+
+/* Function to finish file task t (arg 1) once its data has been copied, or
+ * copying failed as told by rc (arg 2). Called by whoever copied the data,
+ * which is the io_uring engine when -u is in use.
+ */
+void finish_file(struct task *t, int rc){
+  struct dnode *dir = t->dir;
+
+  // A complete copy under a temporary name replaces the old file at once
+  if (t->tmp){
+    COUNT_SYS(SYS_META);
+    if (rc == 0 && renameat(dir->dst_fd, t->tmp, dir->dst_fd, t->name)){
+      printf("ERROR: renaming %s/%s failed!\n", dir->dst, t->tmp);
+      rc = 1;
+    }
+    if (rc)
+      unlinkat(dir->dst_fd, t->tmp, 0);
+  }
+
+  if (rc){
+    printf("ERROR: file copy failed!\n");
+    fail();
+  }
+  else {
+    show_perms(dir->dst, t->name, &t->st);
+    journal_done('F', dir, t->name, t->st.st_size);
+    if (t->link)
+      journal_first(t);
+  }
+
+  // Let the other names of the inode link to the copy now that it is done
+  wake_links(t, rc);
+  release_file(t);
+}
+
+// Links the file open as O_PATH descriptor fd (arg 1) as name (arg 3) in
+// dirfd. Linking a descriptor needs CAP_DAC_READ_SEARCH; without it the
+// link is made through /proc, which names the same open file.
+static int link_fd(int fd, int dirfd, const char *name){
+  char proc[32];
+
+  if (linkat(fd, "", dirfd, name, AT_EMPTY_PATH) == 0)
+    return 0;
+  if (errno != ENOENT && errno != EPERM)
+    return -1;
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  return linkat(AT_FDCWD, proc, dirfd, name, AT_SYMLINK_FOLLOW);
+}
+
+/* Function to give the file of task t (arg 1) the name of the finished
+ * first copy of its inode, h (arg 2). A name that is a link to it already
+ * is left alone. Whatever else the destination holds under that name is
+ * replaced: the link is made under a temporary name and renamed over it,
+ * so the name is never missing. If the first copy failed, the file is
+ * copied on its own instead.
+ */
+static void make_link(struct task *t, struct hardlink *h){
+  struct dnode *dir = t->dir;
+  struct stat d;
+  char *tmp = NULL;
+  int old, rc;
+
+  if (h->state != LINK_DONE){
+    say("Copying %s/%s to %s/%s\n", dir->src, t->name, dir->dst, t->name);
+    finish_file(t, copy(dir->src_fd, dir->dst_fd, t->name, t->name, &t->st));
+    return;
+  }
+
+  old = stats_phase(PH_META);
+  if (stat_at(dir->dst_fd, t->name, &d, 0) == 0 && d.st_dev == h->dst_dev &&
+      d.st_ino == h->dst_ino){
+    stats_phase(old);
+    COUNT(files_skipped, 1);
+    journal_done('F', dir, t->name, 0);
+    put_link(h);
+    release_file(t);
+    return;
+  }
+
+  say("Linking %s/%s to %s\n", dir->dst, t->name, h->path);
+  if (asprintf(&tmp, ".%s.%d.clonetmp", t->name, (int)getpid()) < 0)
+    tmp = NULL;
+  if (tmp && strlen(tmp) > NAME_MAX){
+    free(tmp);
+    tmp = NULL;
+  }
+
+  COUNT_SYS(SYS_META);
+  if (tmp){
+    rc = link_fd(h->fd, dir->dst_fd, tmp);
+    if (rc && errno == EEXIST){
+      // Left by an interrupted run
+      COUNT_SYS(SYS_DIR);
+      unlinkat(dir->dst_fd, tmp, 0);
+      rc = link_fd(h->fd, dir->dst_fd, tmp);
+    }
+    if (rc == 0){
+      COUNT_SYS(SYS_META);
+      rc = renameat(dir->dst_fd, tmp, dir->dst_fd, t->name);
+      if (rc)
+        unlinkat(dir->dst_fd, tmp, 0);
+    }
+  }
+  else {
+    // No room for a temporary name beside this one
+    COUNT_SYS(SYS_DIR);
+    rc = unlinkat(dir->dst_fd, t->name, 0) && errno != ENOENT;
+    if (rc == 0)
+      rc = link_fd(h->fd, dir->dst_fd, t->name);
+  }
+  stats_phase(old);
+  free(tmp);
+
+  if (rc){
+    printf("ERROR: linking %s/%s to %s failed!\n", dir->dst, t->name,
+        h->path);
+    fail();
+  }
+  else {
+    COUNT(files_linked, 1);
+    journal_done('F', dir, t->name, 0);
+  }
+  put_link(h);
+  release_file(t);
+}
+
+/* Function to look up the inode of file task t (arg 1), which has more than
+ * one link. The first of its names to get here is copied as usual, and t
+ * becomes the task the others wait for. The others are linked to the copy,
+ * or queued until it is finished. If done (arg 2) is set, an earlier run of
+ * a resumable clone finished t already; as the first name it is kept as it
+ * is rather than copied.
+ *
+ * Returns 1 if t was handled here, 0 if the caller should copy it, or
+ * release it if done is set.
+ */
+static int claim_link(struct task *t, int done){
+  struct hardlink *h;
+  const char *prior = NULL;
+  char *rel = NULL;
+  int created, first = 0, record = 0;
+
+  if (journal_file)
+    rel = rel_path(t->dir, t->name);
+
+  linkmap_lock();
+  h = linkmap_get(&links, t->st.st_dev, t->st.st_ino, &created);
+  if (h && created){
+    h->left = t->st.st_nlink - 1;
+    prior = journal_link(t->st.st_dev, t->st.st_ino);
+  }
+  if (h && created && prior && !(rel && strcmp(prior, rel) == 0)){
+    // An earlier run of a resumable clone copied the inode already
+    if (asprintf(&h->path, "%s%s", root_dst, prior) < 0)
+      h->path = NULL;
+    h->state = h->path ? hold_first(h, open_rel(root_fd, prior)) :
+      LINK_FAILED;
+    h->left++; // Its own name is still to come, and is left alone
+  }
+  else if (h && created){
+    h->path = join(t->dir->dst, t->name);
+    if (h->path == NULL)
+      h->state = LINK_FAILED;
+    else if (done || prior) // t is the first copy, made by an earlier run
+      h->state = hold_first(h, openat(t->dir->dst_fd, t->name,
+            O_PATH | O_NOFOLLOW));
+    else
+      h->state = LINK_COPYING;
+    first = h->state == LINK_DONE;
+    record = first && prior == NULL; // The earlier run stopped before it
+    if (!first)
+      t->link = h;
+  }
+  else if (h && h->state == LINK_COPYING){
+    t->next = h->waiting;
+    h->waiting = t;
+    linkmap_unlock();
+    free(rel);
     return 1;
   }
+  linkmap_unlock();
+  free(rel);
 
-  dst_fd = open(dst, O_CREAT | O_WRONLY);
-  if (dst_fd  == -1){
-    printf("ERROR: opening destination file failed!\n");
-    close(src_fd);
+  if (first){
+    if (record)
+      journal_first(t);
+    if (done)
+      return 0;
+    release_file(t);
     return 1;
   }
+  if (h == NULL || t->link)
+    return 0; // Copy it, as the first name or for want of memory
+  make_link(t, h);
+  return 1;
+}
 
-  while (nread = read(src_fd, buf, BLOCKSIZE), nread > 0){
-    out_ptr = buf;
-    nwritten = 0;
+// Copy the file of task t unless -i finds it up to date, or it is another
+// name for a file copied already. Takes ownership
+// of t, which may be finished later by the io_uring engine.
+static void copy_file(struct task *t){
+  struct dnode *dir = t->dir;
+  struct stat d;
+  off_t written, size;
+  int rc;
 
-    do {
-      nwritten = write(dst_fd, out_ptr, nread);
-      if (nwritten >= 0){
-        nread -= nwritten;
-        out_ptr += nwritten;
-      }
-      else if (errno != EINTR)
-        return 1; // Ignore termination due to no data transfer
-    } while (nread > 0);
+  if (__atomic_load_n(&failed, __ATOMIC_RELAXED)){
+    release_file(t);
+    return;
   }
 
-  close(dst_fd);
-  close(src_fd);
-  return 0;
+  // The scan only has attributes for entries of unknown type
+  if (!t->have_st && stat_at(dir->src_fd, t->name, &t->st, 0)){
+    printf("ERROR: Could not stat %s/%s\n", dir->src, t->name);
+    finish_file(t, 1);
+    return;
+  }
+  t->have_st = 1;
+  size = t->st.st_size;
+
+  // An earlier run of a resumable clone finished this file already. It is
+  // never replaced, except by a link to the first copy of its inode.
+  if (committed('F', dir, t->name)){
+    if (S_ISREG(t->st.st_mode) && t->st.st_nlink > 1 && claim_link(t, 1))
+      return;
+    COUNT(files_skipped, 1);
+    COUNT(bytes_skipped, size);
+    release_file(t);
+    return;
+  }
 
+  if (S_ISREG(t->st.st_mode) && t->st.st_nlink > 1 && claim_link(t, 0))
+    return;
+
+  // A link is made anew rather than followed, unless -i finds it unchanged
+  if (S_ISLNK(t->st.st_mode) && incremental &&
+      same_symlink(dir->src_fd, dir->dst_fd, t->name, &t->st)){
+    COUNT(files_skipped, 1);
+    finish_file(t, 0);
+    return;
+  }
+  if (S_ISLNK(t->st.st_mode)){
+    say("Copying link %s/%s to %s/%s\n", dir->src, t->name, dir->dst,
+        t->name);
+    COUNT(files_copied, 1);
+    finish_file(t, copy_symlink(dir->src_fd, dir->dst_fd, t->name, &t->st));
+    return;
+  }
+
+  if (incremental && up_to_date(t, &d)){
+    COUNT(files_skipped, 1);
+    COUNT(bytes_skipped, size);
+    finish_file(t, fix_perms(t, &d));
+    return;
+  }
+
+  // Large files whose copy exists get only their changed blocks rewritten
+  if (delta_min && size >= delta_min){
+    rc = delta_copy(dir->src_fd, dir->dst_fd, t->name, &t->st, &written);
+    if (rc >= 0){
+      say("Updating %s/%s in place: %lld of %lld bytes rewritten\n",
+          dir->dst, t->name, (long long)written, (long long)size);
+      COUNT(files_copied, 1);
+      COUNT(bytes_size, size);
+      COUNT(bytes_copied, written);
+      COUNT(bytes_skipped, size - written);
+      finish_file(t, rc);
+      return;
+    }
+  }
+
+  // With -r the data goes to a temporary name first, if the name allows
+  if (journal_file &&
+      asprintf(&t->tmp, ".%s.%d.clonetmp", t->name, (int)getpid()) < 0)
+    t->tmp = NULL;
+  if (t->tmp && strlen(t->tmp) > NAME_MAX){
+    free(t->tmp);
+    t->tmp = NULL;
+  }
+
+  // Entry is a file, so copy it to destination
+  say("Copying %s/%s to %s/%s\n", dir->src, t->name, dir->dst, t->name);
+  COUNT(files_copied, 1);
+  COUNT(bytes_size, size); // The data is counted as it is written
+
+  // The engine writes densely and through the page cache, so sparse files
+  // and those for --direct stay here
+  if (use_uring && !is_sparse(&t->st) && !(direct_min && size >= direct_min))
+    uring_submit(t);
+  else
+    finish_file(t, copy(dir->src_fd, dir->dst_fd, t->name,
+          t->tmp ? t->tmp : t->name, &t->st));
 }
 
-// Removes all files from dst that do not exist in src.
-// Returns 0 for success, 1 for failure.
-int remove_files(char* src, char* dst){
-  DIR *dirp_src, *dirp_dst;
-  struct dirent *entry_src, *entry_dst;
-  char src_file[BUF_LEN+1], dst_file[BUF_LEN+1];
-  int found;
-  
-  if(!strncmp(src, dst, BUF_LEN))
-    return 0; // Base case of recursive function
-    
-  dirp_dst = opendir(dst);
-  if (dirp_dst == NULL){
-    printf("ERROR: Could not open %s\n", dst);
+/* Function to carry out a task, called by the pool. A failed task marks the
+ * whole clone as failed; tasks run after that only release their references.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int run_task(struct task *t){
+  int old, rc = 0;
+
+  if (t->type == TASK_DIR){
+    old = stats_phase(PH_SCAN);
+    rc = clone_recursive(t->dir);
+    free(t);
+  }
+  else {
+    old = stats_phase(PH_DATA);
+    copy_file(t);
+  }
+
+  stats_phase(old);
+  return rc;
+}
+
+/* Function to clone the source directory src (arg 1) into the destination
+ * directory dst (arg 2), open as src_fd and dst_fd (args 3 and 4), using
+ * jobs (arg 5) worker threads, and with -u an io_uring queue depth (arg 6)
+ * of files in flight. The destination is remembered by inode so that the
+ * walk never descends into the copy when the destination lies inside the
+ * source.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int clone(const char* src, const char* dst, int src_fd, int dst_fd, int jobs,
+    int depth){
+  struct dnode *root;
+  struct stat st;
+
+  if (fstat(dst_fd, &st))
+    return 1;
+  abort_dev = st.st_dev;
+  root_len = strlen(src);
+  root_dst = dst;
+  abort_ino = st.st_ino;
+  if (fstat(src_fd, &st))
+    return 1;
+
+  if (use_uring && uring_start(depth)){
+    printf("io_uring is not available; copying synchronously.\n");
+    use_uring = 0;
+  }
+  if (pool_start(jobs)){
+    printf("ERROR: could not start worker threads!\n");
     return 1;
   }
 
-  for (;;){
-    entry_dst = readdir(dirp_dst); // Read each dst entry
-    found = 0;
-    if(entry_dst == NULL)
-      break;
-    if (!strncmp(entry_dst->d_name, "..", 2) || !strncmp(entry_dst->d_name, ".", 1))
-      continue; // Skip ".." and "."
-    snprintf(src_file, BUF_LEN, "%s/%s", src, entry_dst->d_name);
-    snprintf(dst_file, BUF_LEN, "%s/%s", dst, entry_dst->d_name);
-
-    // Recurse up the directory before removing it
-    if (entry_dst->d_type & DT_DIR)
-      if(remove_files(src_file, dst_file))
-        return 1;
-
-    // Open source directory and check if file exists
-    dirp_src = opendir(src);
-    if(dirp_src == NULL){
-      printf("Removing %s\n", dst_file);
-      if (remove(dst_file)){
-        printf("Error: Remove failed!\n");
-        return 1;
-      }
+  // The root gets descriptors of its own, since the scan moves their offset
+  root = new_dnode(NULL, src, &st);
+  free(root->dst);
+  root->dst = strdup(dst);
+  root->src_fd = openat(src_fd, ".", O_RDONLY | O_DIRECTORY);
+  root->dst_fd = openat(dst_fd, ".", O_RDONLY | O_DIRECTORY);
+  root_fd = root->dst_fd;
+  linkmap_init(&links);
+  stats_phase(PH_SCAN);
+  clone_recursive(root);
+  stats_phase(PH_IDLE);
+  pool_finish();
+  if (use_uring)
+    uring_finish();
+  linkmap_free(&links);
+
+  if (show_stats)
+    return failed; // Reported by stats_finish()
+  if (incremental || delta_min)
+    printf("Transferred %lu files (%llu bytes), skipped %lu unchanged files, "
+        "%llu bytes left in place\n", stats.files_copied, stats.bytes_copied,
+        stats.files_skipped, stats.bytes_skipped);
+  if (stats.files_linked)
+    printf("Linked %lu files to copies made already\n", stats.files_linked);
+  if (verify_copies)
+    printf("Verified %lu files against their sources\n",
+        stats.files_verified);
+  return failed;
+}
+
+/* Function to copy files from a source directory to a target directory,
+ * both given by dir (arg 1). Subdirectories are created here and handed to
+ * the pool to be cloned in turn, as are files to be copied. Only entries of
+ * unknown type and directories are looked up with stat_at(); files are left
+ * for the task that copies them. Skips the destination root to avoid copying
+ * the copy.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int clone_recursive(struct dnode *dir){
+  struct dirstream ds;      // Entries of the source directory
+  struct stat st;           // Attributes of an entry, if looked up
+  const char *name;
+  unsigned char type;
+  int have_st, n = 0, rc = 0;
+
+  if (__atomic_load_n(&failed, __ATOMIC_RELAXED)){
+    dir_done(dir);
+    return 0;
+  }
+
+  // Open both directories below the parent's, refusing symbolic links
+  if (dir->parent){
+    COUNT(sys[SYS_DIR], 2);
+    dir->src_fd = openat(dir->parent->src_fd, dir->name,
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dir->dst_fd = openat(dir->parent->dst_fd, dir->name,
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  }
+  if (dir->src_fd == -1 || dir->dst_fd == -1 || dir_open(&ds, dir->src_fd)){
+    printf("ERROR: Could not open %s\n", dir->src_fd == -1 ? dir->src : dir->dst);
+    fail();
+    dir_done(dir);
+    return 1;
+  }
+
+  // Iterate through stream
+  while (!__atomic_load_n(&failed, __ATOMIC_RELAXED) &&
+      (n = dir_read(&ds, &name, &type)) > 0){
+    if (excluded(dir->src_fd, dir->src + root_len, name, &type)){
+      say("Excluding %s/%s\n", dir->src, name);
+      continue;
     }
-    else{
-      // Check each file in source dir for a match against dst dir
-      for (;;){
-        entry_src = readdir(dirp_src);
-        if(entry_src == NULL)
-          break;
-        if (!strncmp(entry_src->d_name, "..", 2) || !strncmp(entry_src->d_name, ".", 1))
-          continue; // Skip ".." and "."
-        
-        snprintf(src_file, BUF_LEN, "%s/%s", src, entry_src->d_name);
-
-        //printf("Checking file %s against %s (Found=%d)\n", entry_dst->d_name, entry_src->d_name, found);
-        if(!strncmp(entry_dst->d_name, entry_src->d_name, BUF_LEN)){
-          found = 1;
-          break;
-        }
+
+    have_st = type == DT_UNKNOWN || type == DT_DIR;
+    if (have_st){
+      if (stat_at(dir->src_fd, name, &st, 0)){
+        printf("ERROR: Could not stat %s/%s\n", dir->src, name);
+        rc = 1;
+        break;
       }
+      type = IFTODT(st.st_mode);
+    }
 
-      if (found == 0){
-        printf("Removing %s\n", dst_file);
-        if(remove(dst_file)){
-          printf("Error: Remove failed!\n");
-          return 1;
-        }
+    if (type == DT_DIR){
+      if (st.st_dev == abort_dev && st.st_ino == abort_ino)
+        continue;  // Skip if directory is the destination
+      if (committed('D', dir, name))
+        continue;  // Finished by an earlier run of a resumable clone
+
+      // Entry is a directory, so create it before anything goes inside
+      say("Creating directory %s/%s\n", dir->dst, name);
+      COUNT(dirs, 1);
+      COUNT_SYS(SYS_DIR);
+      if(mkdirat(dir->dst_fd, name, S_IRWXU) && errno != EEXIST){
+        printf("ERROR: failed to create directory!\n");
+        rc = 1;
+        break;
       }
+
+      // Clone new directory
+      submit(TASK_DIR, new_dnode(dir, name, &st), NULL, NULL);
+    }
+    else if (type == DT_REG || type == DT_LNK){
+      __atomic_add_fetch(&dir->pending, 1, __ATOMIC_RELAXED);
+      submit(TASK_FILE, dir, name, have_st ? &st : NULL);
     }
+    else
+      say("Skipping special file %s/%s\n", dir->src, name);
   }
+  if (n < 0){
+    printf("ERROR: Could not read %s\n", dir->src);
+    rc = 1;
+  }
+  if (rc)
+    fail();
+
+  // Close directory stream
+  dir_close(&ds);
+  dir_done(dir);
+  return rc;
+}
+
 
+/* Removes name (arg 2) from directory dirfd (arg 1) and, if it is a
+ * directory, everything below it. Its d_type is type (arg 3), which may be
+ * DT_UNKNOWN, and path (arg 4) shows it in messages.
+ *
+ * Returns 0 for success, 1 for failure.
+ */
+int remove_tree(int dirfd, const char* name, unsigned char type,
+    const char* path){
+  struct dirstream ds;
+  struct stat st;
+  const char *entry;
+  unsigned char entry_type;
+  char *child;
+  int fd, n = 0, rc = 0;
+
+  if (type == DT_UNKNOWN && stat_at(dirfd, name, &st, 0) == 0)
+    type = IFTODT(st.st_mode);
+
+  if (type == DT_DIR){
+    COUNT(sys[SYS_DIR], 2); // Open and close
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1 || dir_open(&ds, fd)){
+      printf("ERROR: Could not open %s\n", path);
+      if (fd != -1)
+        close(fd);
+      return 1;
+    }
+    while (rc == 0 && (n = dir_read(&ds, &entry, &entry_type)) > 0){
+      child = join(path, entry);
+      rc = child == NULL || remove_tree(fd, entry, entry_type, child);
+      free(child);
+    }
+    dir_close(&ds);
+    close(fd);
+    if (rc || n < 0)
+      return 1;
+  }
+
+  say("Removing %s\n", path);
+  COUNT_SYS(SYS_DIR);
+  if (unlinkat(dirfd, name, type == DT_DIR ? AT_REMOVEDIR : 0)){
+    printf("Error: Remove failed!\n");
+    return 1;
+  }
   return 0;
 }
+
+/* Removes all files and directories from the directory open as dst_fd
+ * (arg 2) that do not exist in the one open as src_fd (arg 1); src and dst
+ * (args 3 and 4) are their paths for messages. The source directory is read
+ * once into a set of names, and each destination entry is looked up in it.
+ * Directories found in both are pruned in turn. A directory that loses
+ * entries gets the times of its source again.
+ *
+ * Returns 0 for success, 1 for failure.
+ */
+int remove_files(int src_fd, int dst_fd, const char* src, const char* dst){
+  struct dirstream ds;
+  struct nameset names;   // Entries of src
+  struct stat st;
+  const char *name;
+  unsigned char type;
+  struct timespec times[2];
+  char *src_child, *dst_child;
+  int sub_src, sub_dst, n = 0, rc = 0, removed = 0;
+
+  if (dir_open(&ds, src_fd)){
+    printf("ERROR: Could not open %s\n", src);
+    return 1;
+  }
+  nameset_init(&names);
+  while (rc == 0 && (n = dir_read(&ds, &name, &type)) > 0)
+    if (nameset_add(&names, name))
+      rc = 1;
+  dir_close(&ds);
+
+  if (rc || n < 0 || dir_open(&ds, dst_fd)){
+    printf("ERROR: Could not open %s\n", rc || n < 0 ? src : dst);
+    nameset_free(&names);
+    return 1;
+  }
+
+  while (rc == 0 && (n = dir_read(&ds, &name, &type)) > 0){
+    if (excluded(dst_fd, src + root_len, name, &type))
+      continue; // Not ours to prune
+    if (type == DT_UNKNOWN && stat_at(dst_fd, name, &st, 0) == 0)
+      type = IFTODT(st.st_mode);
+
+    dst_child = join(dst, name);
+    if (dst_child == NULL)
+      rc = 1;
+    else if (!nameset_has(&names, name)){
+      rc = remove_tree(dst_fd, name, type, dst_child);
+      removed = 1;
+    }
+    else if (type == DT_DIR){
+      src_child = join(src, name);
+      COUNT(sys[SYS_DIR], 4); // Opens and closes
+      sub_src = openat(src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      sub_dst = openat(dst_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      if (src_child && sub_src != -1 && sub_dst != -1 &&
+          fstat(sub_src, &st) == 0 &&
+          (st.st_dev != abort_dev || st.st_ino != abort_ino))
+        rc = remove_files(sub_src, sub_dst, src_child, dst_child);
+      if (sub_src != -1)
+        close(sub_src);
+      if (sub_dst != -1)
+        close(sub_dst);
+      free(src_child);
+    }
+    free(dst_child);
+  }
+  if (n < 0)
+    rc = 1;
+
+  // Removing entries changed the times the clone gave the directory
+  if (removed && fstat(src_fd, &st) == 0){
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    COUNT_SYS(SYS_META);
+    if (futimens(dst_fd, times))
+      rc = 1;
+  }
+
+  dir_close(&ds);
+  nameset_free(&names);
+  return rc;
+}
@@ -0,0 +1,189 @@
+/* Project 4: Clone Utility (clone.h)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Provides declarations shared by the clone utility's source files.
+ */
+
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define TASK_DIR 0   // Scan a directory, creating its subdirectories
+#define TASK_FILE 1  // Copy one file
+
+// Phases that threads charge their time to, for -s
+#define PH_IDLE 0      // Waiting for work; not reported
+#define PH_SCAN 1      // Reading and creating directories
+#define PH_DATA 2      // Moving file data
+#define PH_META 3      // Applying attributes and links
+#define PH_PRUNE 4     // Removing what the source lacks
+#define PH_VERIFY 5    // Reading copies back for --verify
+#define PH_COUNT 6
+
+// Kinds of system calls counted for -s
+#define SYS_DIR 0      // getdents64, mkdir, directory opens, unlink
+#define SYS_STAT 1     // statx and fstatat
+#define SYS_OPEN 2     // File opens and closes
+#define SYS_DATA 3     // read, write, copy_file_range, sendfile, seeks
+#define SYS_META 4     // Owners, modes, times, xattrs and links
+#define SYS_URING 5    // io_uring_enter
+#define SYS_COUNT 6
+
+// Totals of the clone, updated atomically by every thread
+struct clone_stats {
+  unsigned long files_copied, files_skipped, files_linked, dirs;
+  unsigned long files_verified, verify_failed;
+  unsigned long long bytes_copied;    // Data actually written
+  unsigned long long bytes_size;      // Sizes of the files copied
+  unsigned long long bytes_skipped;   // Includes unchanged blocks of -d
+  unsigned long long bytes_verified;  // Read back for --verify
+  unsigned long long ns[PH_COUNT];    // Thread time spent in each phase
+  unsigned long long sys[SYS_COUNT];
+};
+
+extern struct clone_stats stats;
+
+#define COUNT(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define COUNT_SYS(kind) COUNT(sys[kind], 1)
+
+// Decisions of the --filter rules about one entry
+#define FILTER_KEEP 0
+#define FILTER_SKIP 1
+#define FILTER_UNKNOWN 2  // Depends on the type of an entry of unknown type
+
+// States of the first copy of a hard-linked inode
+#define LINK_COPYING 0  // Later links wait for it
+#define LINK_DONE 1     // Later links point at it
+#define LINK_FAILED 2   // Later links are copied on their own
+
+/* Directory being cloned. Its entries are reached through its open source
+ * and destination descriptors, so no path ever has to be built for them;
+ * the paths are kept only for messages.
+ */
+struct dnode {
+  char *src, *dst;        // Paths, for messages
+  char *name;             // Name in the parent, or NULL for the root
+  int src_fd, dst_fd;     // Open from the start of the scan until done
+  struct stat st;         // Source attributes
+  struct dnode *parent;   // NULL for the root of the clone
+  int pending;            // Unfinished scan, files and subdirectories
+};
+
+// Unit of work: scan a directory or copy a file
+struct task {
+  int type;               // TASK_DIR or TASK_FILE
+  struct dnode *dir;      // Directory to scan, or the file's parent
+  char *name;             // File name within dir, for TASK_FILE
+  char *tmp;              // Name the data is written to first with -r
+  struct stat st;         // Source attributes, once have_st is set
+  int have_st;
+  struct hardlink *link;  // Inode whose later links wait for this copy
+  struct task *next;      // Next task waiting on the same inode
+};
+
+// First copy of a source inode that has more than one link
+struct hardlink {
+  dev_t dev;
+  ino_t ino;
+  char *path;             // Destination of the first copy, for messages
+  int fd;                 // O_PATH descriptor of it once done, or -1
+  dev_t dst_dev;          // Its device and inode numbers
+  ino_t dst_ino;
+  int left;               // Other names still to be linked to it
+  int state;              // One of the LINK_ states
+  struct task *waiting;   // Later links that arrived while it was copied
+};
+
+// Map from source inodes to their first copies
+struct linkmap {
+  struct hardlink **slots;
+  size_t cap, count;
+};
+
+// Entries of an open directory, read in large batches
+struct dirstream {
+  int fd;
+  char *buf;
+  long len, pos;          // Bytes in buf, offset of the next entry
+};
+
+// Set of file names, e.g. the entries of one directory
+struct nameset {
+  char **slots;
+  size_t cap, count;
+};
+
+// clone.c
+int run_task(struct task*);
+void finish_file(struct task*, int);
+
+// copy.c
+extern off_t direct_min;
+int copy(int, int, const char*, const char*, const struct stat*);
+int copy_symlink(int, int, const char*, const struct stat*);
+int same_symlink(int, int, const char*, const struct stat*);
+int set_meta(int, int, const struct stat*);
+int same_contents(int, int, const char*);
+int is_sparse(const struct stat*);
+ssize_t pread_full(int, char*, size_t, off_t);
+int pwrite_full(int, const char*, size_t, off_t);
+
+// delta.c
+int delta_copy(int, int, const char*, const struct stat*, off_t*);
+
+// dir.c
+int dir_open(struct dirstream*, int);
+void dir_close(struct dirstream*);
+int dir_read(struct dirstream*, const char**, unsigned char*);
+int stat_at(int, const char*, struct stat*, int);
+
+// filter.c
+int filter_load(const char*);
+int filter_check(const char*, const char*, unsigned char);
+void filter_free(void);
+
+// hash.c
+void nameset_init(struct nameset*);
+void nameset_free(struct nameset*);
+int nameset_add(struct nameset*, const char*);
+int nameset_has(const struct nameset*, const char*);
+void linkmap_lock(void);
+void linkmap_unlock(void);
+void linkmap_init(struct linkmap*);
+void linkmap_free(struct linkmap*);
+struct hardlink *linkmap_get(struct linkmap*, dev_t, ino_t, int*);
+
+// journal.c
+int journal_open(const char*, const struct stat*, const struct stat*, int);
+int journal_has(char, const char*);
+const char *journal_link(dev_t, ino_t);
+int journal_add(char, const char*, long long);
+int journal_close(int);
+
+// pool.c
+int pool_start(int);
+void pool_submit(struct task*);
+void pool_finish(void);
+
+// stats.c
+int stats_phase(int);
+void stats_start(int);
+void stats_finish(void);
+
+// verify.c
+extern int verify_copies;
+void verify_init(void);
+uint32_t crc32c(uint32_t, const void*, size_t);
+int verify_copy(int, int, const uint32_t*, off_t);
+
+// uring.c
+int uring_start(int);
+void uring_submit(struct task*);
+void uring_finish(void);
+
+#endif
@@ -0,0 +1,695 @@
+/* Project 4: Clone Utility (copy.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Moves file data from source to destination. The cheapest transfer the
+ * filesystems support is tried first: a reflink that shares the source's
+ * blocks, then copy_file_range() and sendfile(), which copy inside the
+ * kernel, and finally a read()/write() loop with a large buffer.
+ *
+ * Sparse files are copied one data extent at a time, found with SEEK_DATA
+ * and SEEK_HOLE, so that their holes stay holes in the copy. Large dense
+ * files are preallocated and read with a sequential access hint.
+ *
+ * With --direct, dense files of at least the given size bypass the page
+ * cache: they are read and written with O_DIRECT through two aligned
+ * buffers, one being filled by the calling thread while a second thread
+ * writes the other. Filesystems that refuse O_DIRECT get the usual copy.
+ *
+ * Attributes are applied through the descriptors that are still open from
+ * the copy, using the stat data the caller already has.
+ *
+ * With --verify, dense files skip the in-kernel copies and go through the
+ * buffer, where the source is checksummed on its way to the destination;
+ * the copy is then read back and checked against that checksum.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include "clone.h"
+
+#define COPY_BUFSIZE (1 << 20)  // Buffer for the read()/write() fallback
+#define CHUNK (1 << 30)         // Most bytes asked of the kernel at once
+#define PREALLOC_MIN (1 << 20)  // Smallest dense file worth preallocating
+#define XATTR_MAX (64 * 1024)   // Largest extended attribute value
+#define DIRECT_BUFSIZE (8 << 20) // Each of the two buffers of --direct
+#define DIRECT_ALIGN 4096       // Alignment O_DIRECT needs of buffers, sizes
+                                // and offsets
+
+off_t direct_min;   // --direct: smallest file copied with O_DIRECT, or 0
+
+// Outcomes of one transfer method
+#define XFER_DONE 0         // All data moved
+#define XFER_FAILED 1       // Hard I/O error
+#define XFER_UNSUPPORTED 2  // Method unavailable; try the next one
+
+// Returns 1 if errno means "not for these files" rather than an I/O error
+static int unsupported(void){
+  return errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+    errno == EOPNOTSUPP || errno == ENOTTY;
+}
+
+// Share the source's blocks with the destination on CoW filesystems
+static int try_reflink(int src_fd, int dst_fd){
+#ifdef FICLONE
+  COUNT_SYS(SYS_DATA);
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+    return XFER_DONE;
+  return unsupported() || errno == EPERM ? XFER_UNSUPPORTED : XFER_FAILED;
+#else
+  (void)src_fd;
+  (void)dst_fd;
+  return XFER_UNSUPPORTED;
+#endif
+}
+
+/* Function to copy up to left (arg 3) bytes with copy_file_range() when
+ * use_sendfile (arg 4) is 0, or with sendfile() otherwise. Both advance the
+ * file offsets, so a later method resumes where this one stopped; left is
+ * updated to match.
+ */
+static int try_kernel_copy(int src_fd, int dst_fd, off_t *left,
+    int use_sendfile){
+  ssize_t n;
+  size_t len;
+
+  while (*left > 0){
+    len = *left > CHUNK ? CHUNK : *left;
+    COUNT_SYS(SYS_DATA);
+    if (use_sendfile)
+      n = sendfile(dst_fd, src_fd, NULL, len);
+    else
+      n = copy_file_range(src_fd, NULL, dst_fd, NULL, len, 0);
+
+    if (n > 0){
+      *left -= n;
+      COUNT(bytes_copied, n);
+    }
+    else if (n == 0)
+      return XFER_UNSUPPORTED; // Shorter than stat() said; let read() decide
+    else if (errno != EINTR)
+      return unsupported() ? XFER_UNSUPPORTED : XFER_FAILED;
+  }
+  return XFER_DONE;
+}
+
+// Read until len (arg 3) bytes or end of file. Returns bytes read, -1 on error.
+static ssize_t read_full(int fd, char *buf, size_t len){
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len){
+    COUNT_SYS(SYS_DATA);
+    n = read(fd, buf + done, len - done);
+    if (n == 0)
+      break;
+    if (n < 0){
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += n;
+  }
+  return done;
+}
+
+// Copy whatever remains of src_fd to dst_fd through a userspace buffer.
+// If crc (arg 3) is not NULL, the data is added to it and its length to
+// summed (arg 4).
+static int copy_rw(int src_fd, int dst_fd, uint32_t *crc, off_t *summed){
+  char *buf;                // Buffer for data transfer
+  ssize_t nread, nwritten;  // Keep track of bytes written and read
+  char *out_ptr;
+  int rc = XFER_DONE;
+
+  buf = malloc(COPY_BUFSIZE);
+  if (buf == NULL)
+    return XFER_FAILED;
+
+  while (rc == XFER_DONE){
+    COUNT_SYS(SYS_DATA);
+    nread = read(src_fd, buf, COPY_BUFSIZE);
+    if (nread == 0)
+      break;
+    if (nread < 0){
+      if (errno != EINTR)
+        rc = XFER_FAILED;
+      continue;
+    }
+    if (crc){
+      *crc = crc32c(*crc, buf, nread);
+      *summed += nread;
+    }
+    out_ptr = buf;
+
+    do {
+      COUNT_SYS(SYS_DATA);
+      nwritten = write(dst_fd, out_ptr, nread);
+      if (nwritten >= 0){
+        COUNT(bytes_copied, nwritten);
+        nread -= nwritten;
+        out_ptr += nwritten;
+      }
+      else if (errno != EINTR){
+        rc = XFER_FAILED;
+        break;
+      }
+    } while (nread > 0);
+  }
+
+  free(buf);
+  return rc;
+}
+
+// Read up to len (arg 3) bytes at offset off (arg 4), stopping early only
+// at end of file. Returns bytes read, -1 on error.
+ssize_t pread_full(int fd, char *buf, size_t len, off_t off){
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len){
+    COUNT_SYS(SYS_DATA);
+    n = pread(fd, buf + done, len - done, off + done);
+    if (n == 0)
+      break;
+    if (n < 0){
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += n;
+  }
+  return done;
+}
+
+// Write all of len (arg 3) bytes of buf at offset off (arg 4) of fd.
+// Returns 0 on success, 1 on failure.
+int pwrite_full(int fd, const char *buf, size_t len, off_t off){
+  ssize_t n;
+
+  while (len > 0){
+    COUNT_SYS(SYS_DATA);
+    n = pwrite(fd, buf, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 1;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+// Copy len (arg 3) bytes at offset off (arg 4) from src_fd to the same
+// offset of dst_fd, without moving either file offset.
+static int copy_extent(int src_fd, int dst_fd, off_t off, off_t len){
+  off_t in = off, out = off;
+  char *buf = NULL;
+  ssize_t n;
+  int rc = XFER_DONE;
+
+  while (len > 0){
+    COUNT_SYS(SYS_DATA);
+    if (buf == NULL){
+      n = copy_file_range(src_fd, &in, dst_fd, &out, len > CHUNK ? CHUNK : len,
+          0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n > 0){
+        COUNT(bytes_copied, n);
+        len -= n;
+        continue;
+      }
+      if (n < 0 && !unsupported())
+        return XFER_FAILED;
+      buf = malloc(COPY_BUFSIZE); // Finish with pread() and pwrite()
+      if (buf == NULL)
+        return XFER_FAILED;
+    }
+
+    n = pread(src_fd, buf, len > COPY_BUFSIZE ? COPY_BUFSIZE : len, in);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || pwrite_full(dst_fd, buf, n, out)){
+      rc = n == 0 ? XFER_DONE : XFER_FAILED; // n == 0: file shrank meanwhile
+      break;
+    }
+    COUNT(bytes_copied, n);
+    in += n;
+    out += n;
+    len -= n;
+  }
+
+  free(buf);
+  return rc;
+}
+
+/* Function to copy only the data extents of a sparse source file, leaving
+ * its holes unallocated in the destination, which is then extended to size
+ * (arg 3) so that a trailing hole is kept too.
+ *
+ * Returns XFER_UNSUPPORTED if the filesystem cannot report holes.
+ */
+static int copy_sparse(int src_fd, int dst_fd, off_t size){
+  off_t data = 0, hole;
+
+  for (;;){
+    COUNT(sys[SYS_DATA], 2);
+    data = lseek(src_fd, data, SEEK_DATA);
+    if (data < 0)
+      break;
+    hole = lseek(src_fd, data, SEEK_HOLE);
+    if (hole < 0)
+      return XFER_FAILED;
+    if (copy_extent(src_fd, dst_fd, data, hole - data))
+      return XFER_FAILED;
+    data = hole;
+  }
+  if (errno != ENXIO) // ENXIO: no data past the offset
+    return errno == EINVAL ? XFER_UNSUPPORTED : XFER_FAILED;
+
+  return ftruncate(dst_fd, size) ? XFER_FAILED : XFER_DONE;
+}
+
+// Buffers passed between the reading thread and the writing thread of
+// copy_direct(). A buffer with len 0 is free for the reader.
+struct direct {
+  int dst_fd;
+  char *buf[2];
+  size_t len[2];        // Bytes of data in each buffer
+  off_t off[2];         // Where that data goes
+  int eof;              // The reader has queued everything
+  int err;              // First error, as an errno value
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+// Writes the buffers of struct direct (arg 1) in turn as the reader fills
+// them, until the reader reaches the end or either thread fails
+static void *write_direct(void *param){
+  struct direct *d = param;
+  size_t len, padded;
+  int i = 0, err;
+
+  pthread_mutex_lock(&d->mutex);
+  for (;;){
+    while (d->len[i] == 0 && !d->eof && !d->err)
+      pthread_cond_wait(&d->cond, &d->mutex);
+    if (d->len[i] == 0 || d->err)
+      break;
+    len = d->len[i];
+    pthread_mutex_unlock(&d->mutex);
+
+    // A short last block is padded out; the file is cut to size afterwards
+    padded = (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    memset(d->buf[i] + len, 0, padded - len);
+    errno = 0;
+    err = pwrite_full(d->dst_fd, d->buf[i], padded, d->off[i]) ?
+      (errno ? errno : EIO) : 0;
+    if (err == 0)
+      COUNT(bytes_copied, len);
+
+    pthread_mutex_lock(&d->mutex);
+    if (err && !d->err)
+      d->err = err;
+    d->len[i] = 0;
+    pthread_cond_broadcast(&d->cond);
+    i ^= 1;
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return NULL;
+}
+
+/* Function to copy src_fd to dst_fd with O_DIRECT, reading one buffer while
+ * the other is written. If crc (arg 3) is not NULL, the checksum of the data
+ * is stored there and its length in summed (arg 4). Both descriptors get
+ * their flags back afterwards.
+ *
+ * Returns XFER_UNSUPPORTED, with nothing copied, if O_DIRECT is refused.
+ */
+static int copy_direct(int src_fd, int dst_fd, uint32_t *crc, off_t *summed){
+  struct direct d;
+  pthread_t writer;
+  int src_flags, dst_flags, started = 0, i = 0, err, rc;
+  uint32_t sum = 0;
+  off_t off = 0;
+  ssize_t n;
+
+  COUNT(sys[SYS_DATA], 4);
+  src_flags = fcntl(src_fd, F_GETFL);
+  dst_flags = fcntl(dst_fd, F_GETFL);
+  if (src_flags == -1 || dst_flags == -1 ||
+      fcntl(src_fd, F_SETFL, src_flags | O_DIRECT) ||
+      fcntl(dst_fd, F_SETFL, dst_flags | O_DIRECT)){
+    if (src_flags != -1)
+      fcntl(src_fd, F_SETFL, src_flags);
+    return XFER_UNSUPPORTED;
+  }
+
+  memset(&d, 0, sizeof(d));
+  d.dst_fd = dst_fd;
+  pthread_mutex_init(&d.mutex, NULL);
+  pthread_cond_init(&d.cond, NULL);
+  if (posix_memalign((void **)&d.buf[0], DIRECT_ALIGN, DIRECT_BUFSIZE) ||
+      posix_memalign((void **)&d.buf[1], DIRECT_ALIGN, DIRECT_BUFSIZE))
+    d.err = ENOMEM;
+  else if (pthread_create(&writer, NULL, write_direct, &d))
+    d.err = EAGAIN;
+  else
+    started = 1;
+
+  pthread_mutex_lock(&d.mutex);
+  while (!d.err && !d.eof){
+    while (d.len[i] && !d.err)
+      pthread_cond_wait(&d.cond, &d.mutex);
+    if (d.err)
+      break;
+    pthread_mutex_unlock(&d.mutex);
+
+    COUNT_SYS(SYS_DATA);
+    n = pread(src_fd, d.buf[i], DIRECT_BUFSIZE, off);
+    err = n < 0 ? errno : 0;
+    if (n > 0 && crc)
+      sum = crc32c(sum, d.buf[i], n);
+
+    pthread_mutex_lock(&d.mutex);
+    if (n < 0 && err != EINTR)
+      d.err = err;
+    else if (n >= 0){
+      // Only the end of the file leaves a read short of a whole block
+      d.eof = n == 0 || n % DIRECT_ALIGN;
+      d.len[i] = n;
+      d.off[i] = off;
+      off += n;
+      i ^= 1;
+    }
+    pthread_cond_broadcast(&d.cond);
+  }
+  pthread_mutex_unlock(&d.mutex);
+
+  if (started)
+    pthread_join(writer, NULL);
+  free(d.buf[0]);
+  free(d.buf[1]);
+  pthread_mutex_destroy(&d.mutex);
+  pthread_cond_destroy(&d.cond);
+
+  COUNT(sys[SYS_DATA], 3);
+  fcntl(src_fd, F_SETFL, src_flags);
+  fcntl(dst_fd, F_SETFL, dst_flags);
+  if (d.err == EINVAL){
+    // Refused by the filesystem; drop what was written for the next method
+    return ftruncate(dst_fd, 0) ? XFER_FAILED : XFER_UNSUPPORTED;
+  }
+  rc = d.err || ftruncate(dst_fd, off) ? XFER_FAILED : XFER_DONE;
+  if (crc){
+    *crc = sum;
+    *summed = off;
+  }
+  return rc;
+}
+
+// Returns 1 if the file described by st has fewer blocks than its size needs
+int is_sparse(const struct stat *st){
+  return (off_t)st->st_blocks * 512 < st->st_size;
+}
+
+/* Function to move all data from src_fd to dst_fd, as described by st
+ * (arg 3). If crc (arg 4) is not NULL and the data passes through the
+ * buffer, the checksum of the source is stored there and the number of
+ * bytes it covers in summed (arg 5); otherwise summed is set to -1.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int copy_data(int src_fd, int dst_fd, const struct stat *st,
+    uint32_t *crc, off_t *summed){
+  off_t size = st->st_size, left = size;
+  int rc;
+
+  *summed = -1;
+  if (size > 0){
+    rc = try_reflink(src_fd, dst_fd);
+    if (rc != XFER_UNSUPPORTED)
+      return rc;
+
+    if (is_sparse(st)){
+      rc = copy_sparse(src_fd, dst_fd, size);
+      if (rc != XFER_UNSUPPORTED)
+        return rc;
+      lseek(src_fd, 0, SEEK_SET); // Fall back to a dense copy
+    }
+    else if (size >= PREALLOC_MIN){
+      // Failures here only cost speed, so they are ignored
+      COUNT(sys[SYS_DATA], 2);
+      fallocate(dst_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+      posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (direct_min && size >= direct_min && !is_sparse(st)){
+      rc = copy_direct(src_fd, dst_fd, crc, summed);
+      if (rc != XFER_UNSUPPORTED)
+        return rc;
+    }
+
+    // Data the kernel copies is never seen here, so --verify reads it
+    rc = crc ? XFER_UNSUPPORTED : try_kernel_copy(src_fd, dst_fd, &left, 0);
+    if (rc == XFER_UNSUPPORTED && crc == NULL)
+      rc = try_kernel_copy(src_fd, dst_fd, &left, 1);
+    if (rc == XFER_FAILED)
+      return 1;
+  }
+
+  // Pick up anything the kernel paths left, including data beyond size
+  if (crc){
+    *crc = 0;
+    *summed = 0;
+  }
+  return copy_rw(src_fd, dst_fd, crc, summed) == XFER_DONE ? 0 : 1;
+}
+
+// Returns 1 if errno means the attribute cannot or may not be copied here,
+// as with trusted.* attributes for an unprivileged user
+static int xattr_unsupported(void){
+  return errno == ENOTSUP || errno == EPERM;
+}
+
+// Copy the extended attributes of src_fd to dst_fd, which include POSIX
+// ACLs. Returns 0 on success, 1 on failure.
+static int copy_xattrs(int src_fd, int dst_fd){
+  char *names, *value, *name;
+  ssize_t len, n;
+  int rc = 0;
+
+  COUNT_SYS(SYS_META);
+  len = flistxattr(src_fd, NULL, 0);
+  if (len <= 0)
+    return len < 0 && !xattr_unsupported();
+
+  names = malloc(len);
+  value = malloc(XATTR_MAX);
+  if (names && value){
+    COUNT_SYS(SYS_META);
+    len = flistxattr(src_fd, names, len);
+  }
+  if (names == NULL || value == NULL || len < 0)
+    rc = 1;
+
+  // The list holds the names one after another, each ending in '\0'
+  for (name = names; rc == 0 && name < names + len; name += strlen(name) + 1){
+    COUNT(sys[SYS_META], 2);
+    n = fgetxattr(src_fd, name, value, XATTR_MAX);
+    if (n < 0){
+      rc = errno != ENODATA; // ENODATA: removed meanwhile
+      continue;
+    }
+    if (fsetxattr(dst_fd, name, value, n, 0) && !xattr_unsupported())
+      rc = 1;
+  }
+
+  free(names);
+  free(value);
+  return rc;
+}
+
+/* Function to give dst_fd (arg 2) the attributes st (arg 3) of src_fd
+ * (arg 1): owner and group, extended attributes, permissions and times.
+ * The owner goes first because changing it clears set-user-ID bits, and the
+ * times go last so that nothing disturbs them.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int set_meta(int src_fd, int dst_fd, const struct stat* st){
+  struct timespec times[2];
+  int old = stats_phase(PH_META), rc;
+
+  // Keep timestamps so that -i can tell unchanged files on the next run
+  times[0] = st->st_atim;
+  times[1] = st->st_mtim;
+
+  COUNT(sys[SYS_META], 3);
+  rc = fchown(dst_fd, st->st_uid, st->st_gid) ||
+    copy_xattrs(src_fd, dst_fd) || fchmod(dst_fd, st->st_mode & 07777) ||
+    futimens(dst_fd, times);
+
+  stats_phase(old);
+  return rc;
+}
+
+/* Function to recreate symbolic link name (arg 3) of directory src_dir
+ * (arg 1) in dst_dir (arg 2), replacing any file there, and give the link
+ * itself the owner and times in st (arg 4). Links have no permissions.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int copy_symlink(int src_dir, int dst_dir, const char* name,
+    const struct stat* st){
+  char target[PATH_MAX];
+  struct timespec times[2];
+  ssize_t n;
+
+  COUNT(sys[SYS_META], 5);
+  n = readlinkat(src_dir, name, target, sizeof(target));
+  if (n < 0 || n == sizeof(target)){
+    printf("ERROR: reading link failed!\n");
+    return 1;
+  }
+  target[n] = '\0';
+
+  if ((unlinkat(dst_dir, name, 0) && errno != ENOENT) ||
+      symlinkat(target, dst_dir, name)){
+    printf("ERROR: creating link failed!\n");
+    return 1;
+  }
+
+  times[0] = st->st_atim;
+  times[1] = st->st_mtim;
+  if (fchownat(dst_dir, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) ||
+      utimensat(dst_dir, name, times, AT_SYMLINK_NOFOLLOW)){
+    printf("ERROR: failed to set permissions!\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Function to decide whether symbolic link name (arg 3) of dst_dir (arg 2)
+ * is already a copy of the one in src_dir (arg 1), whose attributes are st
+ * (arg 4): same target, owner and modification time.
+ *
+ * Returns 1 if it is, 0 otherwise.
+ */
+int same_symlink(int src_dir, int dst_dir, const char* name,
+    const struct stat* st){
+  char target[PATH_MAX], copied[PATH_MAX];
+  struct stat d;
+  ssize_t n;
+
+  if (stat_at(dst_dir, name, &d, 0) || !S_ISLNK(d.st_mode) ||
+      d.st_size != st->st_size || d.st_uid != st->st_uid ||
+      d.st_gid != st->st_gid || d.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+      d.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+    return 0;
+
+  COUNT(sys[SYS_META], 2);
+  n = readlinkat(src_dir, name, target, sizeof(target));
+  if (n < 0 || n == sizeof(target) ||
+      readlinkat(dst_dir, name, copied, sizeof(copied)) != n)
+    return 0;
+  return memcmp(target, copied, n) == 0;
+}
+
+/* Function to copy file name (arg 3) from the directory open as src_dir
+ * (arg 1) to the name to (arg 4) in the directory open as dst_dir (arg 2).
+ * The source's attributes are st (arg 5), which the copy receives along
+ * with the data.
+ *
+ * Returns 0 on successful copy, 1 on failure
+ */
+int copy(int src_dir, int dst_dir, const char* name, const char* to,
+    const struct stat* st){
+  int src_fd, dst_fd;   // Holds src/dst file descriptors
+  uint32_t crc;         // Checksum of the source, for --verify
+  off_t summed;
+  int rc;
+
+  // Open files
+  COUNT(sys[SYS_OPEN], 4);
+  src_fd = openat(src_dir, name, O_RDONLY);
+  if (src_fd == -1){
+    printf("ERROR: opening source file failed!\n");
+    return 1;
+  }
+
+  dst_fd = openat(dst_dir, to,
+      O_CREAT | O_TRUNC | (verify_copies ? O_RDWR : O_WRONLY),
+      S_IRUSR | S_IWUSR);
+  if (dst_fd  == -1){
+    printf("ERROR: opening destination file failed!\n");
+    close(src_fd);
+    return 1;
+  }
+
+  rc = copy_data(src_fd, dst_fd, st, verify_copies ? &crc : NULL, &summed);
+  if (rc == 0 && verify_copies &&
+      verify_copy(src_fd, dst_fd, summed >= 0 ? &crc : NULL, summed)){
+    printf("ERROR: verifying %s failed!\n", name);
+    rc = 1;
+  }
+  if (rc == 0 && set_meta(src_fd, dst_fd, st)){
+    printf("ERROR: failed to set permissions!\n");
+    rc = 1;
+  }
+
+  if (close(dst_fd))
+    rc = 1;
+  close(src_fd);
+  return rc;
+}
+
+// Function to compare the contents of file name in directories src_dir and
+// dst_dir. Returns 1 if they are identical, 0 if not or if either cannot be
+// read.
+int same_contents(int src_dir, int dst_dir, const char* name){
+  int fd_a, fd_b, same = 0;
+  char *buf_a, *buf_b;
+  ssize_t n_a, n_b;
+
+  COUNT(sys[SYS_OPEN], 4);
+  fd_a = openat(src_dir, name, O_RDONLY);
+  fd_b = openat(dst_dir, name, O_RDONLY);
+  buf_a = malloc(COPY_BUFSIZE);
+  buf_b = malloc(COPY_BUFSIZE);
+
+  if (fd_a != -1 && fd_b != -1 && buf_a && buf_b){
+    for (;;){
+      n_a = read_full(fd_a, buf_a, COPY_BUFSIZE);
+      n_b = read_full(fd_b, buf_b, COPY_BUFSIZE);
+      if (n_a < 0 || n_a != n_b || memcmp(buf_a, buf_b, n_a))
+        break;
+      if (n_a == 0){
+        same = 1;
+        break;
+      }
+    }
+  }
+
+  free(buf_a);
+  free(buf_b);
+  if (fd_a != -1)
+    close(fd_a);
+  if (fd_b != -1)
+    close(fd_b);
+  return same;
+}
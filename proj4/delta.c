@@ -0,0 +1,152 @@
+/* Project 4: Clone Utility (delta.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * In-place delta update of a large file whose copy already exists. Both
+ * files are compared in fixed blocks and only the blocks that differ are
+ * rewritten, so a file that was appended to or lightly modified costs reads
+ * of both copies but writes of only the changed blocks. The file is split
+ * into contiguous ranges that are compared by several threads at once.
+ * With --verify every rewritten block is read back and compared; the others
+ * already matched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "clone.h"
+
+#define DELTA_BLOCK (1 << 20)   // Bytes per compared block
+#define DELTA_THREADS 8         // Most threads comparing one file
+
+// Blocks [start, end) of one file, handled by one thread
+struct range {
+  int src_fd, dst_fd;
+  off_t start, end;       // Byte offsets, block aligned except the end
+  off_t written;          // Bytes rewritten
+  int err;
+  int started;            // A thread of its own was created
+  pthread_t thread;
+};
+
+static void *update_range(void *param){
+  struct range *r = param;
+  char *a, *b;
+  ssize_t na, nb;
+  off_t off;
+  size_t len;
+
+  a = malloc(DELTA_BLOCK);
+  b = malloc(DELTA_BLOCK);
+  r->err = a == NULL || b == NULL;
+
+  for (off = r->start; !r->err && off < r->end; off += DELTA_BLOCK){
+    len = r->end - off < DELTA_BLOCK ? r->end - off : DELTA_BLOCK;
+    na = pread_full(r->src_fd, a, len, off);
+    nb = pread_full(r->dst_fd, b, len, off);
+    if (na < 0 || nb < 0){
+      r->err = 1;
+      break;
+    }
+    if (na == nb && memcmp(a, b, na) == 0)
+      continue; // Block unchanged
+
+    if (pwrite_full(r->dst_fd, a, na, off))
+      r->err = 1;
+    else if (verify_copies){
+      nb = pread_full(r->dst_fd, b, na, off);
+      COUNT(bytes_verified, na);
+      r->err = nb != na || memcmp(a, b, na);
+      if (r->err)
+        COUNT(verify_failed, 1);
+    }
+    r->written += na;
+  }
+
+  free(a);
+  free(b);
+  return NULL;
+}
+
+/* Function to bring the existing copy of file name (arg 3) in the directory
+ * open as dst_dir (arg 2) up to date with the one in src_dir (arg 1), whose
+ * attributes are st (arg 4), by rewriting only the blocks that differ and
+ * then applying the attributes. The number of bytes rewritten is stored in
+ * written (arg 5).
+ *
+ * Returns 0 on success, 1 on failure, and -1 if dst is not a regular file
+ * that could be updated, in which case a full copy is needed instead.
+ */
+int delta_copy(int src_dir, int dst_dir, const char* name,
+    const struct stat* st, off_t* written){
+  struct range ranges[DELTA_THREADS];
+  struct stat dst_st;
+  off_t blocks, per;
+  int src_fd, dst_fd, n, i, rc = 0;
+
+  *written = 0;
+  COUNT(sys[SYS_OPEN], 4);
+  dst_fd = openat(dst_dir, name, O_RDWR);
+  if (dst_fd == -1)
+    return -1;
+  if (fstat(dst_fd, &dst_st) || !S_ISREG(dst_st.st_mode)){
+    close(dst_fd);
+    return -1;
+  }
+
+  src_fd = openat(src_dir, name, O_RDONLY);
+  if (src_fd == -1){
+    close(dst_fd);
+    return 1;
+  }
+  posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(dst_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Give each thread an equal run of whole blocks
+  blocks = (st->st_size + DELTA_BLOCK - 1) / DELTA_BLOCK;
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > DELTA_THREADS)
+    n = DELTA_THREADS;
+  if (n > blocks)
+    n = blocks;
+  if (n < 1)
+    n = 1;
+  per = (blocks + n - 1) / n;
+
+  for (i = 0; i < n; i++){
+    ranges[i].src_fd = src_fd;
+    ranges[i].dst_fd = dst_fd;
+    ranges[i].start = i * per * DELTA_BLOCK;
+    ranges[i].end = (i + 1) * per * DELTA_BLOCK;
+    if (ranges[i].end > st->st_size)
+      ranges[i].end = st->st_size;
+    ranges[i].written = 0;
+    ranges[i].err = 0;
+    ranges[i].started = i > 0 &&
+      pthread_create(&ranges[i].thread, NULL, update_range, &ranges[i]) == 0;
+  }
+
+  // The calling thread takes the first range, and any that got no thread
+  for (i = 0; i < n; i++){
+    if (ranges[i].started)
+      pthread_join(ranges[i].thread, NULL);
+    else
+      update_range(&ranges[i]);
+    rc |= ranges[i].err;
+    *written += ranges[i].written;
+  }
+
+  // Drop whatever the copy has beyond the end of the source
+  if (rc == 0 && ftruncate(dst_fd, st->st_size))
+    rc = 1;
+  if (rc == 0 && verify_copies)
+    COUNT(files_verified, 1);
+  if (rc == 0 && set_meta(src_fd, dst_fd, st))
+    rc = 1;
+  if (close(dst_fd))
+    rc = 1;
+  close(src_fd);
+  return rc;
+}
@@ -0,0 +1,120 @@
+/* Project 4: Clone Utility (dir.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Directory access relative to open directory descriptors. Entries are read
+ * with getdents64() into a large buffer, so a big directory costs few system
+ * calls, and attributes come from statx() asking only for the fields the
+ * clone uses. Neither needs a path from the root of the tree.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include "clone.h"
+
+#define DIRBUF_LEN (64 * 1024)  // Bytes of entries read per getdents64()
+
+// Layout of the records returned by getdents64()
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Returns 1 for the "." and ".." entries of a directory
+static int is_dot(const char* name){
+  return name[0] == '.' && (name[1] == '\0' ||
+      (name[1] == '.' && name[2] == '\0'));
+}
+
+// Prepares to read the directory open as fd, which stays owned by the
+// caller. Returns 0 on success, 1 on failure.
+int dir_open(struct dirstream *ds, int fd){
+  ds->fd = fd;
+  ds->len = ds->pos = 0;
+  ds->buf = malloc(DIRBUF_LEN);
+  return ds->buf == NULL;
+}
+
+void dir_close(struct dirstream *ds){
+  free(ds->buf);
+  ds->buf = NULL;
+}
+
+/* Function to read the next entry other than "." and "..", storing its name
+ * in name (arg 2) and its d_type in type (arg 3). The name is valid until
+ * the next call.
+ *
+ * Returns 1 for an entry, 0 at the end of the directory, -1 on error.
+ */
+int dir_read(struct dirstream *ds, const char **name, unsigned char *type){
+  struct linux_dirent64 *d;
+  long n;
+
+  for (;;){
+    if (ds->pos >= ds->len){
+      COUNT_SYS(SYS_DIR);
+      n = syscall(SYS_getdents64, ds->fd, ds->buf, DIRBUF_LEN);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return n < 0 ? -1 : 0;
+      ds->len = n;
+      ds->pos = 0;
+    }
+
+    d = (struct linux_dirent64 *)(ds->buf + ds->pos);
+    ds->pos += d->d_reclen;
+    if (is_dot(d->d_name))
+      continue;
+    *name = d->d_name;
+    *type = d->d_type;
+    return 1;
+  }
+}
+
+/* Function to get the attributes of name (arg 2) in directory dirfd into st
+ * (arg 3), following a symbolic link only if follow (arg 4) is set. Fields
+ * the clone does not use, such as the change time, are left zero.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int stat_at(int dirfd, const char* name, struct stat* st, int follow){
+#ifdef STATX_BASIC_STATS
+  static int no_statx = 0;
+  struct statx stx;
+  int flags = AT_STATX_SYNC_AS_STAT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+
+  COUNT_SYS(SYS_STAT);
+  if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)){
+    if (statx(dirfd, name, flags, STATX_BASIC_STATS & ~STATX_CTIME, &stx) == 0){
+      memset(st, 0, sizeof(*st));
+      st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      st->st_ino = stx.stx_ino;
+      st->st_mode = stx.stx_mode;
+      st->st_nlink = stx.stx_nlink;
+      st->st_uid = stx.stx_uid;
+      st->st_gid = stx.stx_gid;
+      st->st_size = stx.stx_size;
+      st->st_blocks = stx.stx_blocks;
+      st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+      st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+      st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+      st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+      return 0;
+    }
+    if (errno != ENOSYS)
+      return -1;
+    __atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+  }
+#endif
+  return fstatat(dirfd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+}
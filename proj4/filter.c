@@ -0,0 +1,162 @@
+/* Project 4: Clone Utility (filter.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Include and exclude rules for --filter, read from a file with one rule per
+ * line. Blank lines and lines starting with '#' are ignored.
+ *   - PATTERN    exclude entries matching PATTERN
+ *   + PATTERN    include them, even if a later rule excludes them
+ *   PATTERN      same as "- PATTERN"
+ * The first rule that matches an entry decides; entries no rule matches are
+ * included. Patterns are shell globs (*, ?, [...]) that never match a '/'.
+ * A pattern ending in '/' matches only directories. A pattern holding any
+ * other '/' is matched against the path from the root of the clone, with or
+ * without a leading '/'; others are matched against the entry's name alone.
+ *
+ * The rules are compiled once when loaded: patterns without glob characters
+ * are compared as plain strings, and the path of an entry is only built if
+ * some rule needs it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include "clone.h"
+
+// One rule of the filter file
+struct rule {
+  char *pattern;
+  int include;          // + rather than -
+  int dir_only;         // Pattern ended in '/'
+  int by_path;          // Matched against the path rather than the name
+  int literal;          // No glob characters; compared with strcmp()
+};
+
+static struct rule *rules;
+static int count;
+
+// Adds the rule on line (arg 1), which holds no newline.
+// Returns 0 on success, 1 on failure.
+static int add_rule(char *line){
+  struct rule *r, *grown;
+  size_t len;
+  int anchored;
+
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\0' || *line == '#')
+    return 0;
+
+  grown = realloc(rules, (count + 1) * sizeof(struct rule));
+  if (grown == NULL)
+    return 1;
+  rules = grown;
+  r = &rules[count];
+  r->include = 0;
+  if ((line[0] == '+' || line[0] == '-') && line[1] == ' '){
+    r->include = line[0] == '+';
+    line += 2;
+  }
+
+  len = strlen(line);
+  r->dir_only = len > 1 && line[len - 1] == '/';
+  if (r->dir_only)
+    line[--len] = '\0';
+  anchored = line[0] == '/';
+  if (anchored)
+    line++;
+  if (*line == '\0')
+    return 0; // Nothing left to match
+
+  r->pattern = strdup(line);
+  if (r->pattern == NULL)
+    return 1;
+  r->by_path = anchored || strchr(line, '/') != NULL;
+  r->literal = strpbrk(line, "*?[\\") == NULL;
+  count++;
+  return 0;
+}
+
+/* Function to read the rules of the filter file file (arg 1).
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int filter_load(const char *file){
+  FILE *f;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int rc = 0;
+
+  f = fopen(file, "r");
+  if (f == NULL)
+    return 1;
+  while (rc == 0 && (len = getline(&line, &cap, f)) > 0){
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    rc = add_rule(line);
+  }
+  if (ferror(f))
+    rc = 1;
+  free(line);
+  fclose(f);
+  return rc;
+}
+
+static int matches(const struct rule *r, const char *s){
+  if (r->literal)
+    return strcmp(r->pattern, s) == 0;
+  return fnmatch(r->pattern, s, FNM_PATHNAME) == 0;
+}
+
+/* Function to apply the rules to entry name (arg 2) of the directory whose
+ * path from the root of the clone is dir (arg 1): "" for the root itself,
+ * otherwise starting with '/'. Its d_type is type (arg 3), which may be
+ * DT_UNKNOWN.
+ *
+ * Returns FILTER_KEEP or FILTER_SKIP, or FILTER_UNKNOWN if the decision
+ * needs the type of an entry of unknown type.
+ */
+int filter_check(const char *dir, const char *name, unsigned char type){
+  char *path = NULL;
+  const char *s;
+  int i, rc = FILTER_KEEP;
+
+  for (i = 0; i < count; i++){
+    if (rules[i].dir_only && type != DT_DIR && type != DT_UNKNOWN)
+      continue;
+    s = name;
+    if (rules[i].by_path){
+      if (path == NULL && asprintf(&path, "%s%s%s", *dir ? dir + 1 : "",
+            *dir ? "/" : "", name) < 0)
+        path = NULL;
+      if (path == NULL)
+        continue;
+      s = path;
+    }
+    if (!matches(&rules[i], s))
+      continue;
+
+    if (rules[i].dir_only && type == DT_UNKNOWN)
+      rc = FILTER_UNKNOWN;
+    else
+      rc = rules[i].include ? FILTER_KEEP : FILTER_SKIP;
+    break;
+  }
+
+  free(path);
+  return rc;
+}
+
+void filter_free(void){
+  int i;
+
+  for (i = 0; i < count; i++)
+    free(rules[i].pattern);
+  free(rules);
+  rules = NULL;
+  count = 0;
+}
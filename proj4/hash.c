@@ -0,0 +1,184 @@
+/* Project 4: Clone Utility (hash.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Hashing for the clone utility. A name set holds the entries of one
+ * directory so that others can be checked against it in constant time. It
+ * uses open addressing with linear probing and is kept at most half full.
+ * A link map is built the same way and finds the first copy of a source
+ * inode by its device and inode numbers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "clone.h"
+
+#define SET_MIN 64  // Initial slot count; always a power of two
+
+// 64-bit FNV-1a hash of a NUL-terminated string
+static uint64_t hash_str(const char *s){
+  uint64_t h = 14695981039346656037ULL;
+  while (*s){
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void nameset_init(struct nameset *set){
+  set->slots = calloc(SET_MIN, sizeof(char *));
+  set->cap = set->slots ? SET_MIN : 0;
+  set->count = 0;
+}
+
+void nameset_free(struct nameset *set){
+  size_t i;
+  for (i = 0; i < set->cap; i++)
+    free(set->slots[i]);
+  free(set->slots);
+  set->slots = NULL;
+  set->cap = set->count = 0;
+}
+
+// Returns the slot holding name, or the empty slot where it belongs
+static size_t probe(char **slots, size_t cap, const char *name){
+  size_t i = hash_str(name) & (cap - 1);
+  while (slots[i] && strcmp(slots[i], name))
+    i = (i + 1) & (cap - 1);
+  return i;
+}
+
+static int grow(struct nameset *set){
+  char **slots;
+  size_t i, cap = set->cap * 2;
+
+  slots = calloc(cap, sizeof(char *));
+  if (slots == NULL)
+    return 1;
+  for (i = 0; i < set->cap; i++)
+    if (set->slots[i])
+      slots[probe(slots, cap, set->slots[i])] = set->slots[i];
+  free(set->slots);
+  set->slots = slots;
+  set->cap = cap;
+  return 0;
+}
+
+// Adds a copy of name to set. Returns 0 on success, 1 if out of memory.
+int nameset_add(struct nameset *set, const char *name){
+  size_t i;
+
+  if (set->cap == 0 || (set->count + 1) * 2 > set->cap)
+    if (set->cap == 0 || grow(set))
+      return 1;
+
+  i = probe(set->slots, set->cap, name);
+  if (set->slots[i] == NULL){
+    set->slots[i] = strdup(name);
+    if (set->slots[i] == NULL)
+      return 1;
+    set->count++;
+  }
+  return 0;
+}
+
+// Returns 1 if name is in set, 0 otherwise.
+int nameset_has(const struct nameset *set, const char *name){
+  if (set->cap == 0)
+    return 0;
+  return set->slots[probe(set->slots, set->cap, name)] != NULL;
+}
+
+// Guards link maps, which workers share; also held around uses of entries
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void linkmap_lock(void){
+  pthread_mutex_lock(&link_mutex);
+}
+
+void linkmap_unlock(void){
+  pthread_mutex_unlock(&link_mutex);
+}
+
+void linkmap_init(struct linkmap *map){
+  map->slots = calloc(SET_MIN, sizeof(struct hardlink *));
+  map->cap = map->slots ? SET_MIN : 0;
+  map->count = 0;
+}
+
+void linkmap_free(struct linkmap *map){
+  size_t i;
+  for (i = 0; i < map->cap; i++)
+    if (map->slots[i]){
+      free(map->slots[i]->path);
+      if (map->slots[i]->fd != -1)
+        close(map->slots[i]->fd);
+      free(map->slots[i]);
+    }
+  free(map->slots);
+  map->slots = NULL;
+  map->cap = map->count = 0;
+}
+
+// Returns the slot holding (dev, ino), or the empty slot where it belongs
+static size_t probe_ino(struct hardlink **slots, size_t cap, dev_t dev,
+    ino_t ino){
+  uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 40)) * 11400714785074694791ULL;
+  size_t i = (h ^ (h >> 32)) & (cap - 1);
+
+  while (slots[i] && (slots[i]->ino != ino || slots[i]->dev != dev))
+    i = (i + 1) & (cap - 1);
+  return i;
+}
+
+static int grow_links(struct linkmap *map){
+  struct hardlink **slots, *h;
+  size_t i, cap = map->cap * 2;
+
+  slots = calloc(cap, sizeof(struct hardlink *));
+  if (slots == NULL)
+    return 1;
+  for (i = 0; i < map->cap; i++){
+    h = map->slots[i];
+    if (h)
+      slots[probe_ino(slots, cap, h->dev, h->ino)] = h;
+  }
+  free(map->slots);
+  map->slots = slots;
+  map->cap = cap;
+  return 0;
+}
+
+/* Function to look up inode ino (arg 3) of device dev (arg 2) in map,
+ * adding a zeroed entry for it if there is none, in which case created
+ * (arg 4) is set.
+ *
+ * Returns the entry, or NULL if out of memory.
+ */
+struct hardlink *linkmap_get(struct linkmap *map, dev_t dev, ino_t ino,
+    int *created){
+  struct hardlink *h;
+  size_t i;
+
+  *created = 0;
+  if (map->cap == 0 || (map->count + 1) * 2 > map->cap)
+    if (map->cap == 0 || grow_links(map))
+      return NULL;
+
+  i = probe_ino(map->slots, map->cap, dev, ino);
+  if (map->slots[i] == NULL){
+    h = calloc(1, sizeof(struct hardlink));
+    if (h == NULL)
+      return NULL;
+    h->dev = dev;
+    h->ino = ino;
+    h->fd = -1;
+    map->slots[i] = h;
+    map->count++;
+    *created = 1;
+  }
+  return map->slots[i];
+}
@@ -0,0 +1,289 @@
+/* Project 4: Clone Utility (journal.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Progress journal for resumable clones (-r). Files finished since the last
+ * commit, and directories whose whole subtree is finished, are gathered in
+ * memory. A commit makes the destination durable with one syncfs() and only
+ * then appends their records to the journal, so anything the journal names
+ * is on disk. A clone restarted with the same journal skips those files and
+ * does not even scan those directories.
+ *
+ * Each record is one line: a type letter, a space and the path relative to
+ * the root of the clone. F records a file, D a directory, and L the first
+ * copy of a hard-linked inode, whose path follows its device and inode
+ * numbers. A line cut short by a crash has no newline and is ignored. The
+ * journal is removed once the clone has finished.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "clone.h"
+
+#define JOURNAL_FILES 4096              // Records per commit, at most
+#define JOURNAL_BYTES (1LL << 30)       // File data per commit, at most
+#define JOURNAL_SECS 5                  // Seconds between commits, at most
+#define HEADER_LEN 128
+
+static int fd = -1;             // The journal, open for appending
+static int sync_fd;             // Directory on the destination filesystem
+static char *path;
+static struct nameset done;     // Records read back from an earlier run
+static struct linkmap earlier;  // Their hard-linked inodes, by source inode
+static char *batch;             // Records waiting for the next commit
+static size_t batch_len, batch_cap, batch_count;
+static long long batch_bytes;
+static time_t last_commit;
+static int committing;          // A commit is writing its records
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t committed = PTHREAD_COND_INITIALIZER; // One finished
+
+// Write all of len (arg 2) bytes of buf to the journal
+static int write_all(const char *buf, size_t len){
+  ssize_t n;
+
+  while (len > 0){
+    n = write(fd, buf, len);
+    if (n <= 0)
+      return 1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Remembers the first copy in an L record, given without its type
+static int add_link(const char *rec){
+  unsigned long long dev, ino;
+  struct hardlink *h;
+  int n = 0, created;
+
+  if (sscanf(rec, "%llu:%llu %n", &dev, &ino, &n) < 2 || n == 0)
+    return 0; // Not one of ours; ignore it
+  h = linkmap_get(&earlier, dev, ino, &created);
+  if (h == NULL)
+    return 1;
+  if (created)
+    h->path = strdup(rec + n);
+  return 0;
+}
+
+// Read back the records of the journal, which starts with header (arg 1)
+static int load(const char *header){
+  char *buf = NULL, *line, *end;
+  size_t cap = 0, len = 0;
+  ssize_t n;
+
+  for (;;){
+    if (len == cap){
+      cap = cap ? cap * 2 : 1 << 16;
+      line = realloc(buf, cap);
+      if (line == NULL){
+        free(buf);
+        return 1;
+      }
+      buf = line;
+    }
+    n = read(fd, buf + len, cap - len);
+    if (n < 0){
+      free(buf);
+      return 1;
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  if (len < strlen(header) || strncmp(buf, header, strlen(header))){
+    printf("ERROR: journal %s belongs to another clone\n", path);
+    free(buf);
+    return 1;
+  }
+
+  line = buf + strlen(header);
+  while ((end = memchr(line, '\n', buf + len - line)) != NULL){
+    *end = '\0';
+    if ((line[0] == 'L' && add_link(line + 2)) || nameset_add(&done, line)){
+      free(buf);
+      return 1;
+    }
+    line = end + 1;
+  }
+  free(buf);
+  return 0;
+}
+
+/* Function to open or create the journal at file (arg 1) for a clone from
+ * src (arg 2) to dst (arg 3), whose destination is open as dst_fd (arg 4).
+ * A journal left by an interrupted run of the same clone is read back.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int journal_open(const char *file, const struct stat *src,
+    const struct stat *dst, int dst_fd){
+  char header[HEADER_LEN];
+  struct stat st;
+
+  snprintf(header, HEADER_LEN, "clone journal 1 %llu:%llu %llu:%llu\n",
+      (unsigned long long)src->st_dev, (unsigned long long)src->st_ino,
+      (unsigned long long)dst->st_dev, (unsigned long long)dst->st_ino);
+  path = strdup(file);
+  nameset_init(&done);
+  linkmap_init(&earlier);
+  fd = open(file, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+  if (path == NULL || fd == -1 || fstat(fd, &st)){
+    printf("ERROR: Could not open journal %s\n", file);
+    return 1;
+  }
+
+  if (st.st_size > 0){
+    if (load(header))
+      return 1;
+    printf("Resuming from journal %s: %lu entries done\n", file,
+        (unsigned long)done.count);
+  }
+  else if (write_all(header, strlen(header)) || fdatasync(fd)){
+    printf("ERROR: Could not write journal %s\n", file);
+    return 1;
+  }
+
+  sync_fd = dst_fd;
+  last_commit = time(NULL);
+  return 0;
+}
+
+// Returns 1 if an earlier run committed the record type (arg 1) for rel
+int journal_has(char type, const char *rel){
+  char *line;
+  int found;
+
+  if (fd == -1 || done.count == 0)
+    return 0;
+  if (asprintf(&line, "%c %s", type, rel) < 0)
+    return 0;
+  found = nameset_has(&done, line);
+  free(line);
+  return found;
+}
+
+// Returns the path, relative to the root of the clone, of the copy an
+// earlier run made of inode ino (arg 2) of device dev, or NULL. Called with
+// the link maps locked.
+const char *journal_link(dev_t dev, ino_t ino){
+  struct hardlink *h;
+  int created;
+
+  if (fd == -1 || earlier.count == 0)
+    return NULL;
+  h = linkmap_get(&earlier, dev, ino, &created);
+  return h ? h->path : NULL;
+}
+
+/* Function to make everything done so far durable and append its records.
+ * Called with the mutex held, which is dropped while the destination is
+ * synced: the batch is taken over first, so other threads keep adding
+ * records to a new one meanwhile. One commit runs at a time, so records
+ * reach the journal in order; a commit that finds another running leaves
+ * its records for the next one unless wait (arg 1) is set.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int commit(int wait){
+  char *records;
+  size_t len;
+  int old, rc = 0;
+
+  while (wait && committing)
+    pthread_cond_wait(&committed, &mutex);
+  if (batch_count == 0 || committing)
+    return 0;
+
+  records = batch;
+  len = batch_len;
+  batch = NULL;
+  batch_len = batch_cap = batch_count = 0;
+  batch_bytes = 0;
+  last_commit = time(NULL);
+  committing = 1;
+  pthread_mutex_unlock(&mutex);
+
+  old = stats_phase(PH_DATA);
+  COUNT(sys[SYS_DATA], 3);
+  if (syncfs(sync_fd) || write_all(records, len) || fdatasync(fd)){
+    printf("ERROR: Could not commit journal %s\n", path);
+    rc = 1;
+  }
+  stats_phase(old);
+  free(records);
+
+  pthread_mutex_lock(&mutex);
+  committing = 0;
+  pthread_cond_broadcast(&committed);
+  return rc;
+}
+
+/* Function to record that rel (arg 2), a file holding bytes (arg 3) of data
+ * or a finished directory as told by type (arg 1), is complete in the
+ * destination. The record is written by a later commit.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int journal_add(char type, const char *rel, long long bytes){
+  size_t len = strlen(rel) + 4; // Type, space, newline and sprintf()'s NUL
+  char *grown;
+  int rc = 0;
+
+  if (fd == -1 || strchr(rel, '\n') || journal_has(type, rel))
+    return 0; // Such a name is just copied again on resume, or is known
+
+  pthread_mutex_lock(&mutex);
+  if (batch_len + len > batch_cap){
+    grown = realloc(batch, (batch_len + len) * 2);
+    if (grown == NULL){
+      pthread_mutex_unlock(&mutex);
+      return 1;
+    }
+    batch = grown;
+    batch_cap = (batch_len + len) * 2;
+  }
+  batch_len += sprintf(batch + batch_len, "%c %s\n", type, rel);
+  batch_count++;
+  batch_bytes += bytes;
+
+  if (batch_count >= JOURNAL_FILES || batch_bytes >= JOURNAL_BYTES ||
+      time(NULL) - last_commit >= JOURNAL_SECS)
+    rc = commit(0);
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+/* Function to close the journal, committing what is left. Once the clone
+ * is finished (arg 1) the journal is no longer needed and is removed.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int journal_close(int finished){
+  int rc;
+
+  if (fd == -1)
+    return 0;
+  pthread_mutex_lock(&mutex);
+  rc = commit(1);
+  pthread_mutex_unlock(&mutex);
+
+  close(fd);
+  fd = -1;
+  if (finished && rc == 0)
+    unlink(path);
+  nameset_free(&done);
+  linkmap_free(&earlier);
+  free(batch);
+  free(path);
+  return rc;
+}
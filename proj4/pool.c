@@ -0,0 +1,109 @@
+/* Project 4: Clone Utility (pool.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Worker pool for parallel clones. Tasks wait in a bounded FIFO until one of
+ * the worker threads runs them. Workers submit tasks of their own while
+ * scanning directories, so a submitter that finds the queue full runs the
+ * task itself instead of waiting; this bounds memory without deadlock. With
+ * a single job there are no workers and every task runs in the submitter.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "clone.h"
+
+#define QUEUE_LEN 1024  // Tasks waiting for a worker
+
+static struct task *queue[QUEUE_LEN];
+static int count, in, out;
+static int busy;         // Tasks queued or running
+static int stopping;     // Set by pool_finish() once busy drops to zero
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;  // Queue not empty
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;  // busy became 0
+static pthread_t *workers;
+static int num_workers = 0;
+
+static void *worker(void *param){
+  struct task *t;
+  (void)param;
+
+  pthread_mutex_lock(&mutex);
+  for (;;){
+    while (count == 0 && !stopping)
+      pthread_cond_wait(&work, &mutex);
+    if (count == 0)
+      break; // Stopping and nothing left
+
+    t = queue[out];
+    out = (out + 1) % QUEUE_LEN;
+    count--;
+    pthread_mutex_unlock(&mutex);
+
+    run_task(t);
+
+    pthread_mutex_lock(&mutex);
+    if (--busy == 0)
+      pthread_cond_broadcast(&idle);
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+// Starts jobs (arg 1) worker threads; a single job needs none.
+// Returns 0 on success, 1 on failure.
+int pool_start(int jobs){
+  int i;
+
+  if (jobs < 2)
+    return 0;
+
+  workers = malloc(jobs * sizeof(pthread_t));
+  if (workers == NULL)
+    return 1;
+  for (i = 0; i < jobs; i++){
+    if (pthread_create(&workers[i], NULL, worker, NULL)){
+      pool_finish();
+      return 1;
+    }
+    num_workers++;
+  }
+  return 0;
+}
+
+// Queues task t, or runs it right away if there are no workers or the
+// queue is full.
+void pool_submit(struct task *t){
+  if (num_workers){
+    pthread_mutex_lock(&mutex);
+    if (count < QUEUE_LEN){
+      queue[in] = t;
+      in = (in + 1) % QUEUE_LEN;
+      count++;
+      busy++;
+      pthread_cond_signal(&work);
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+  run_task(t);
+}
+
+// Waits until every queued task has run, then stops the workers
+void pool_finish(void){
+  int i;
+
+  pthread_mutex_lock(&mutex);
+  while (busy > 0)
+    pthread_cond_wait(&idle, &mutex);
+  stopping = 1;
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&mutex);
+
+  for (i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  num_workers = 0;
+}
@@ -0,0 +1,143 @@
+/* Project 4: Clone Utility (stats.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Counters and timers for the clone. The counters are always kept; with -s
+ * a thread also prints the progress once a second, and a report of rates,
+ * system calls and time per phase is printed at the end.
+ *
+ * Every thread charges its time to the phase it is in, switching phases with
+ * stats_phase() and switching back when done, so that work nested inside
+ * other work (tasks run by their submitter) is charged correctly.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "clone.h"
+
+struct clone_stats stats;
+
+static int timing;                      // -s is on
+static unsigned long long started;      // When stats_start() was called
+static __thread int phase;              // Phase of this thread
+static __thread unsigned long long since; // When this thread entered it
+
+static pthread_t progress;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static int stopping, running, shown;
+
+static const char *phase_names[PH_COUNT] = {
+  NULL, "traversal", "data copy", "metadata", "pruning", "verification"
+};
+static const char *sys_names[SYS_COUNT] = {
+  "directory", "stat", "open/close", "data", "metadata", "io_uring_enter"
+};
+
+static unsigned long long now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double mb(unsigned long long bytes){
+  return bytes / (1024.0 * 1024.0);
+}
+
+/* Function to switch the calling thread to phase p (arg 1), charging the
+ * time since its last switch to the phase it leaves.
+ *
+ * Returns the phase left, for the caller to switch back to.
+ */
+int stats_phase(int p){
+  unsigned long long t;
+  int old = phase;
+
+  if (timing && p != old){
+    t = now_ns();
+    if (old != PH_IDLE && since)
+      __atomic_add_fetch(&stats.ns[old], t - since, __ATOMIC_RELAXED);
+    since = t;
+  }
+  phase = p;
+  return old;
+}
+
+static void *show_progress(void *param){
+  unsigned long long copied, last = 0, t, last_t = started;
+  struct timespec wake;
+  (void)param;
+
+  pthread_mutex_lock(&mutex);
+  while (!stopping){
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec++;
+    pthread_cond_timedwait(&done, &mutex, &wake);
+    if (stopping)
+      break;
+
+    t = now_ns();
+    copied = __atomic_load_n(&stats.bytes_copied, __ATOMIC_RELAXED);
+    fprintf(stderr, "\r%lu files, %lu directories, %.1f MB, %.1f MB/s   ",
+        __atomic_load_n(&stats.files_copied, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.dirs, __ATOMIC_RELAXED), mb(copied),
+        mb(copied - last) / ((t - last_t) / 1e9));
+    last = copied;
+    last_t = t;
+    shown = 1;
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+// Starts timing, and with show (arg 1) the progress display.
+void stats_start(int show){
+  started = now_ns();
+  timing = show;
+  if (show)
+    running = pthread_create(&progress, NULL, show_progress, NULL) == 0;
+}
+
+// Stops the progress display and prints the report of -s
+void stats_finish(void){
+  double secs = (now_ns() - started) / 1e9;
+  int i;
+
+  if (running){
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_signal(&done);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(progress, NULL);
+    if (shown)
+      fprintf(stderr, "\n");
+    running = 0;
+  }
+  if (!timing)
+    return;
+  if (secs <= 0)
+    secs = 1e-9;
+
+  printf("Cloned %lu files (%.1f MB written) in %.2f s: %.1f files/s, "
+      "%.1f MB/s\n", stats.files_copied, mb(stats.bytes_copied), secs,
+      stats.files_copied / secs, mb(stats.bytes_copied) / secs);
+  printf("  %.1f MB of file size copied; holes and reflinked blocks are not "
+      "written\n", mb(stats.bytes_size));
+  printf("  %lu directories, %lu files linked, %lu unchanged files skipped "
+      "(%.1f MB left in place)\n", stats.dirs, stats.files_linked,
+      stats.files_skipped, mb(stats.bytes_skipped));
+
+  if (verify_copies)
+    printf("  %lu files verified (%.1f MB read back), %lu mismatches\n",
+        stats.files_verified, mb(stats.bytes_verified), stats.verify_failed);
+
+  printf("  Thread time:");
+  for (i = 1; i < PH_COUNT; i++)
+    printf(" %s %.3f s%s", phase_names[i], stats.ns[i] / 1e9,
+        i + 1 < PH_COUNT ? "," : "\n");
+  printf("  System calls:");
+  for (i = 0; i < SYS_COUNT; i++)
+    printf(" %llu %s%s", stats.sys[i], sys_names[i],
+        i + 1 < SYS_COUNT ? "," : "\n");
+}
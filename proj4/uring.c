@@ -0,0 +1,495 @@
+/* Project 4: Clone Utility (uring.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * io_uring engine for copying file data. One thread owns a ring and keeps up
+ * to depth files in flight, each in a slot with its own registered buffer.
+ * A file's opens are submitted together, then reads and writes alternate
+ * through the slot's buffer. The file's attributes are then set through
+ * the open descriptors, and finally both are closed by the ring as well.
+ * With --verify the source is checksummed as each read completes, and the
+ * copy is read back through the ring before its attributes are set.
+ * Completions for different files arrive in any order, so a single thread
+ * keeps many requests queued at the device.
+ *
+ * The ring is driven through the raw system calls. If the kernel lacks
+ * io_uring or any of the operations used here, uring_start() fails and the
+ * caller copies synchronously instead. A file that fails inside the ring is
+ * retried once with copy().
+ *
+ * The retry, set_meta() and the linking of a finished file's other names
+ * run on the engine thread, so while they do no completions are reaped.
+ * They are rare or cheap beside the data; the pool is not used for them
+ * because it is shut down before the engine drains.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "clone.h"
+
+#define URING_BUFSIZE (256 * 1024)  // Buffer per slot
+
+// Operation tags, kept in the low bits of user_data beside the slot index
+#define OP_OPEN_SRC 0
+#define OP_OPEN_DST 1
+#define OP_READ 2
+#define OP_WRITE 3
+#define OP_CLOSE_SRC 4
+#define OP_CLOSE_DST 5
+#define OP_CHECK 6      // Read of the copy, for --verify
+#define OP_BITS 3
+
+// One file being copied
+struct slot {
+  struct task *task;    // NULL when the slot is free
+  int src_fd, dst_fd;
+  int inflight;         // Operations submitted but not completed
+  int err;              // First error seen, as an errno value
+  off_t off;            // File offset of the data in buf
+  unsigned len, done;   // Bytes in buf, bytes of those written
+  char *buf;
+  uint32_t crc, check;  // Checksums of the source and of the copy
+  off_t checked;        // Bytes of the copy read back
+};
+
+// Mapped rings of the io_uring instance
+static struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned to_submit;   // SQEs filled in since the last io_uring_enter()
+} ring;
+
+static struct slot *slots;
+static int depth;
+static int fixed;       // Buffers are registered, so use the _FIXED ops
+static char *buffers;
+
+// Files waiting for a slot. Submitters block while it is full.
+static struct task **pending;
+static int pending_len, pending_count, pending_in, pending_out;
+static int stopping;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER;
+static pthread_t engine;
+static int running;     // The engine thread has been started
+
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+  COUNT_SYS(SYS_URING);
+  return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags,
+      NULL, 0);
+}
+
+static int reg(unsigned opcode, void *arg, unsigned nr_args){
+  return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+// Returns 1 if the kernel supports every operation used here
+static int probe_ops(void){
+  static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ,
+    IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    IORING_OP_CLOSE };
+  struct io_uring_probe *probe;
+  size_t i;
+  int ok;
+
+  probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (probe == NULL)
+    return 0;
+  ok = reg(IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+    ok = ops[i] <= probe->last_op &&
+      (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+static int map_rings(unsigned entries){
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring.fd < 0)
+    return 1;
+
+  ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    if (ring.cq_len > ring.sq_len)
+      ring.sq_len = ring.cq_len;
+    ring.cq_len = 0;
+  }
+
+  ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ptr == MAP_FAILED)
+    return 1;
+  if (ring.cq_len){
+    ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED)
+      return 1;
+  }
+  else
+    ring.cq_ptr = ring.sq_ptr;
+
+  ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+    return 1;
+
+  ring.sq_head = (unsigned *)((char *)ring.sq_ptr + p.sq_off.head);
+  ring.sq_tail = (unsigned *)((char *)ring.sq_ptr + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)((char *)ring.sq_ptr + p.sq_off.array);
+  ring.cq_head = (unsigned *)((char *)ring.cq_ptr + p.cq_off.head);
+  ring.cq_tail = (unsigned *)((char *)ring.cq_ptr + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+  return 0;
+}
+
+static void unmap_rings(void){
+  if (ring.sqes && ring.sqes != MAP_FAILED)
+    munmap(ring.sqes, ring.sqes_len);
+  if (ring.cq_len && ring.cq_ptr && ring.cq_ptr != MAP_FAILED)
+    munmap(ring.cq_ptr, ring.cq_len);
+  if (ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+    munmap(ring.sq_ptr, ring.sq_len);
+  if (ring.fd >= 0)
+    close(ring.fd);
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+// Claims the next submission entry, tagged with slot index s and op. The
+// caller fills it in and then publishes it with push_sqe(). The ring has
+// room for two entries per slot, so it never runs out.
+static struct io_uring_sqe *get_sqe(int s, int op){
+  unsigned idx = *ring.sq_tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = ((__u64)s << OP_BITS) | op;
+  ring.sq_array[idx] = idx;
+  slots[s].inflight++;
+  return sqe;
+}
+
+// Hands the entry filled in since get_sqe() to the kernel. The release
+// store orders its contents before the new tail.
+static void push_sqe(void){
+  __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+  ring.to_submit++;
+}
+
+static void prep_open(int s, int op, int dirfd, const char *name, int flags){
+  struct io_uring_sqe *sqe = get_sqe(s, op);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = dirfd;
+  sqe->addr = (unsigned long)name;
+  sqe->open_flags = flags;
+  sqe->len = S_IRUSR | S_IWUSR; // Mode; set_perms() fixes it afterwards
+  push_sqe();
+}
+
+static void prep_rw(int s, int op, int fd, char *buf, unsigned len, off_t off){
+  struct io_uring_sqe *sqe = get_sqe(s, op);
+  if (fixed){
+    sqe->opcode = op == OP_WRITE ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = s;
+  }
+  else
+    sqe->opcode = op == OP_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = off;
+  push_sqe();
+}
+
+static void prep_close(int s, int op, int fd){
+  struct io_uring_sqe *sqe = get_sqe(s, op);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  push_sqe();
+}
+
+static void start_slot(int s, struct task *t){
+  struct slot *sl = &slots[s];
+
+  sl->task = t;
+  sl->src_fd = sl->dst_fd = -1;
+  sl->err = 0;
+  sl->off = 0;
+  sl->crc = sl->check = 0;
+  sl->checked = 0;
+  prep_open(s, OP_OPEN_SRC, t->dir->src_fd, t->name, O_RDONLY);
+  prep_open(s, OP_OPEN_DST, t->dir->dst_fd, t->tmp ? t->tmp : t->name,
+      (verify_copies ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC);
+}
+
+static void close_slot(int s){
+  struct slot *sl = &slots[s];
+
+  if (sl->src_fd >= 0)
+    prep_close(s, OP_CLOSE_SRC, sl->src_fd);
+  if (sl->dst_fd >= 0)
+    prep_close(s, OP_CLOSE_DST, sl->dst_fd);
+}
+
+// Hands a finished file back; returns 1 to say the slot is free again.
+static int complete_slot(int s){
+  struct slot *sl = &slots[s];
+  struct task *t = sl->task;
+
+  sl->task = NULL;
+  finish_file(t, sl->err ?
+      copy(t->dir->src_fd, t->dir->dst_fd, t->name, t->tmp ? t->tmp : t->name,
+        &t->st) : 0);
+  return 1;
+}
+
+// Advances slot s past the completion of op with result res.
+// Returns 1 if the slot became free.
+static int handle(int s, int op, int res){
+  struct slot *sl = &slots[s];
+
+  sl->inflight--;
+  if (res < 0 && (res == -EINTR || res == -EAGAIN) &&
+      (op == OP_READ || op == OP_WRITE || op == OP_CHECK)){
+    if (op == OP_READ)
+      prep_rw(s, OP_READ, sl->src_fd, sl->buf, URING_BUFSIZE, sl->off);
+    else if (op == OP_CHECK)
+      prep_rw(s, OP_CHECK, sl->dst_fd, sl->buf, URING_BUFSIZE, sl->checked);
+    else
+      prep_rw(s, OP_WRITE, sl->dst_fd, sl->buf + sl->done,
+          sl->len - sl->done, sl->off + sl->done);
+    return 0;
+  }
+  if (res < 0 && !sl->err && op != OP_CLOSE_SRC)
+    sl->err = -res; // Only a failed close of the source does not matter
+
+  switch (op){
+    case OP_OPEN_SRC:
+    case OP_OPEN_DST:
+      if (res >= 0)
+        *(op == OP_OPEN_SRC ? &sl->src_fd : &sl->dst_fd) = res;
+      if (sl->inflight > 0)
+        return 0; // Wait for the other open
+      if (sl->err)
+        break;
+      prep_rw(s, OP_READ, sl->src_fd, sl->buf, URING_BUFSIZE, 0);
+      return 0;
+
+    case OP_READ:
+      if (res == 0 && verify_copies && !sl->err){
+        prep_rw(s, OP_CHECK, sl->dst_fd, sl->buf, URING_BUFSIZE, 0);
+        return 0; // Read the copy back before finishing
+      }
+      if (res <= 0)
+        break; // End of file or error
+      if (verify_copies)
+        sl->crc = crc32c(sl->crc, sl->buf, res);
+      sl->len = res;
+      sl->done = 0;
+      prep_rw(s, OP_WRITE, sl->dst_fd, sl->buf, sl->len, sl->off);
+      return 0;
+
+    case OP_WRITE:
+      if (res == 0 && !sl->err)
+        sl->err = EIO;
+      if (res <= 0)
+        break;
+      COUNT(bytes_copied, res);
+      sl->done += res;
+      if (sl->done < sl->len)
+        prep_rw(s, OP_WRITE, sl->dst_fd, sl->buf + sl->done,
+            sl->len - sl->done, sl->off + sl->done);
+      else {
+        sl->off += sl->len;
+        prep_rw(s, OP_READ, sl->src_fd, sl->buf, URING_BUFSIZE, sl->off);
+      }
+      return 0;
+
+    case OP_CHECK:
+      if (res > 0){
+        COUNT(bytes_verified, res);
+        sl->check = crc32c(sl->check, sl->buf, res);
+        sl->checked += res;
+        if (sl->checked <= sl->off){
+          prep_rw(s, OP_CHECK, sl->dst_fd, sl->buf, URING_BUFSIZE,
+              sl->checked);
+          return 0;
+        }
+      }
+      if (sl->err)
+        break;
+      if (sl->check != sl->crc || sl->checked != sl->off){
+        sl->err = EIO; // copy() tries the file again, and checks it too
+        COUNT(verify_failed, 1);
+      }
+      else
+        COUNT(files_verified, 1);
+      break;
+
+    default: // A close
+      if (op == OP_CLOSE_SRC)
+        sl->src_fd = -1;
+      else
+        sl->dst_fd = -1;
+      return sl->inflight == 0 ? complete_slot(s) : 0;
+  }
+
+  // Apply the attributes while both descriptors are still open
+  if (!sl->err && set_meta(sl->src_fd, sl->dst_fd, &sl->task->st))
+    sl->err = errno ? errno : EIO;
+  close_slot(s);
+  return sl->inflight == 0 ? complete_slot(s) : 0;
+}
+
+// Handles every completion available. Returns the number of slots freed.
+static int reap(void){
+  unsigned head = *ring.cq_head;
+  struct io_uring_cqe *cqe;
+  int freed = 0;
+
+  while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)){
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    freed += handle(cqe->user_data >> OP_BITS,
+        cqe->user_data & ((1 << OP_BITS) - 1), cqe->res);
+    head++;
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return freed;
+}
+
+static void *engine_main(void *param){
+  int active = 0, submitted, s;
+  (void)param;
+
+  pthread_mutex_lock(&mutex);
+  for (;;){
+    while (!stopping && pending_count == 0 && active == 0)
+      pthread_cond_wait(&work, &mutex);
+    if (stopping && pending_count == 0 && active == 0)
+      break;
+
+    // Give waiting files to free slots
+    for (s = 0; s < depth && pending_count > 0; s++){
+      if (slots[s].task)
+        continue;
+      start_slot(s, pending[pending_out]);
+      pending_out = (pending_out + 1) % pending_len;
+      pending_count--;
+      active++;
+      pthread_cond_signal(&space);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    // Submit everything queued and wait for at least one completion
+    stats_phase(PH_DATA);
+    submitted = enter(ring.to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (submitted >= 0)
+      ring.to_submit -= submitted;
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      abort(); // The ring itself is broken; nothing sensible to do
+    active -= reap();
+    stats_phase(PH_IDLE);
+
+    pthread_mutex_lock(&mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+/* Function to set up a ring with room for queue_depth (arg 1) files in
+ * flight and start the engine thread.
+ *
+ * Returns 0 on success, 1 if io_uring cannot be used.
+ */
+int uring_start(int queue_depth){
+  struct iovec *iov;
+  int s;
+
+  ring.fd = -1;
+  depth = queue_depth;
+  if (map_rings(2 * depth) || !probe_ops()){
+    unmap_rings();
+    return 1;
+  }
+
+  slots = calloc(depth, sizeof(struct slot));
+  buffers = malloc((size_t)depth * URING_BUFSIZE);
+  pending_len = 4 * depth;
+  pending = malloc(pending_len * sizeof(struct task *));
+  iov = malloc(depth * sizeof(struct iovec));
+  if (!slots || !buffers || !pending || !iov){
+    free(iov);
+    uring_finish();
+    return 1;
+  }
+
+  for (s = 0; s < depth; s++){
+    slots[s].buf = buffers + (size_t)s * URING_BUFSIZE;
+    iov[s].iov_base = slots[s].buf;
+    iov[s].iov_len = URING_BUFSIZE;
+  }
+  // Registration pins the buffers; without it plain reads and writes work
+  fixed = reg(IORING_REGISTER_BUFFERS, iov, depth) == 0;
+  free(iov);
+
+  if (pthread_create(&engine, NULL, engine_main, NULL)){
+    uring_finish();
+    return 1;
+  }
+  running = 1;
+  return 0;
+}
+
+// Queues file task t for the engine, waiting while too many are queued.
+// The engine calls finish_file() for it when done.
+void uring_submit(struct task *t){
+  pthread_mutex_lock(&mutex);
+  while (pending_count == pending_len)
+    pthread_cond_wait(&space, &mutex);
+  pending[pending_in] = t;
+  pending_in = (pending_in + 1) % pending_len;
+  pending_count++;
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Waits until every queued file is done, then stops the engine
+void uring_finish(void){
+  if (running){
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(engine, NULL);
+    running = 0;
+  }
+
+  unmap_rings();
+  free(slots);
+  free(buffers);
+  free(pending);
+  slots = NULL;
+  buffers = NULL;
+  pending = NULL;
+}
@@ -0,0 +1,137 @@
+/* Project 4: Clone Utility (verify.c)
+ * Corey Johns
+ * COP4610 Spring 2013
+ *
+ * Checks copies for --verify. Files are compared by CRC32C, which SSE4.2
+ * computes eight bytes per instruction; processors without it use a table.
+ * Wherever the data passes through the clone's own buffers, the source's
+ * checksum is taken from the bytes as they are copied, so that only the
+ * destination has to be read back. Otherwise both files are read again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "clone.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define VERIFY_BUFSIZE (1 << 20)  // Bytes read back at once
+#define CRC32C_POLY 0x82f63b78    // Castagnoli polynomial, reflected
+
+int verify_copies;                // --verify: check every copy made
+
+static uint32_t table[256];       // For processors without SSE4.2
+static int have_sse42;
+
+/* Function to prepare the checksums: detect SSE4.2 and fill the table.
+ * Called once, before any thread is started.
+ */
+void verify_init(void){
+  uint32_t crc;
+  int i, bit;
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+
+  if (__get_cpuid(1, &a, &b, &c, &d))
+    have_sse42 = (c & bit_SSE4_2) != 0;
+#endif
+
+  for (i = 0; i < 256; i++){
+    crc = i;
+    for (bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    table[i] = crc;
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len){
+  unsigned long long c = crc, word;
+
+  for (; len > 0 && ((uintptr_t)p & 7); len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  for (; len >= 8; len -= 8, p += 8){
+    memcpy(&word, p, 8);
+    c = __builtin_ia32_crc32di(c, word);
+  }
+  for (; len > 0; len--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  return c;
+}
+#endif
+
+/* Function to extend checksum crc (arg 1) of earlier data by len (arg 3)
+ * bytes of buf (arg 2). A checksum starts at 0.
+ *
+ * Returns the new checksum.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (have_sse42)
+    return ~crc_sse42(crc, p, len);
+#endif
+  while (len-- > 0)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Checksums fd from its start to its end into crc and len.
+// Returns 0 on success, 1 on a read error.
+static int sum_file(int fd, char *buf, uint32_t *crc, off_t *len){
+  ssize_t n;
+
+  *crc = 0;
+  *len = 0;
+  while ((n = pread_full(fd, buf, VERIFY_BUFSIZE, *len)) > 0){
+    *crc = crc32c(*crc, buf, n);
+    *len += n;
+    COUNT(bytes_verified, n);
+  }
+  return n < 0;
+}
+
+/* Function to check that dst_fd (arg 2) holds the same data as src_fd
+ * (arg 1). If the source's checksum is known already, crc (arg 3) points to
+ * it and len (arg 4) is the number of bytes it covers; if crc is NULL, the
+ * source is read again.
+ *
+ * Returns 0 if the files match, 1 if they differ or cannot be read.
+ */
+int verify_copy(int src_fd, int dst_fd, const uint32_t *crc, off_t len){
+  uint32_t src_crc, dst_crc;
+  off_t dst_len;
+  char *buf;
+  int old = stats_phase(PH_VERIFY), rc = 1;
+
+  buf = malloc(VERIFY_BUFSIZE);
+  if (buf && crc){
+    src_crc = *crc;
+    rc = 0;
+  }
+  else if (buf)
+    rc = sum_file(src_fd, buf, &src_crc, &len);
+  if (rc == 0)
+    rc = sum_file(dst_fd, buf, &dst_crc, &dst_len) ||
+      dst_crc != src_crc || dst_len != len;
+  free(buf);
+
+  // What --direct kept out of the page cache should not end up there now
+  if (direct_min && len >= direct_min){
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  if (rc)
+    COUNT(verify_failed, 1);
+  else
+    COUNT(files_verified, 1);
+  stats_phase(old);
+  return rc;
+}